@@ -0,0 +1,232 @@
+// Headless benchmark for AISystem::Step.
+// Fills the registry with a synthetic scene of skeletons, goblins, mushrooms and bats, runs Step for a fixed number of
+// frames without a window, a renderer or the other systems, and reports ns per agent per frame for each part of the AI
+// update.
+//
+// usage: ai_benchmark [--layout clustered|uniform|player] [--frames N] [--seed N] [--parallel] [--batched] [--fused] [--flocks] [--lod] [--budget MS] [--fast-math] [--decoys N] [counts...]
+// e.g.   ai_benchmark --layout clustered 10 100 1000 10000 100000
+
+// internal
+#include "ai_system.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+enum class SceneLayout { Clustered, Uniform, AroundPlayer };
+
+struct BenchmarkOptions {
+	SceneLayout layout = SceneLayout::Uniform;
+	int frames = 300;
+	uint64_t seed = 1;
+	bool parallel = false;
+	bool batched = false;
+	bool fused = false;
+	bool flocks = false;
+	bool lod = false;
+	float budgetMs = 0;
+	bool fastMath = false;
+	int decoys = 0;
+	std::vector<int> counts;
+};
+
+const float BENCH_FRAME_MS = 1000.f / 60.f;
+// keeps the density of the uniform layout the same at every agent count
+const float BENCH_AREA_PER_AGENT = 64.f * 64.f;
+const int BENCH_SWARM_SIZE = 50;
+const float BENCH_SWARM_RADIUS = 150.f;
+const float BENCH_PLAYER_RING = 400.f;
+
+// plain LCG, the scene only has to be the same for the same seed
+static float NextFloat(uint64_t& state) {
+	state = state * 6364136223846793005ull + 1442695040888963407ull;
+	return (float)(state >> 40) / (float)(1ull << 24);
+}
+
+static vec2 SpawnPosition(SceneLayout layout, int index, float worldSize, vec2 playerPos, std::vector<vec2>& swarmCenters, uint64_t& rng) {
+	switch (layout) {
+	case SceneLayout::Clustered: {
+		int swarm = index / BENCH_SWARM_SIZE;
+		while ((int)swarmCenters.size() <= swarm) {
+			swarmCenters.push_back(vec2(NextFloat(rng) * worldSize, NextFloat(rng) * worldSize));
+		}
+		float angle = NextFloat(rng) * 6.2831853f;
+		float radius = NextFloat(rng) * BENCH_SWARM_RADIUS;
+		return swarmCenters[swarm] + vec2(cos(angle) * radius, sin(angle) * radius);
+	}
+	case SceneLayout::AroundPlayer: {
+		float angle = NextFloat(rng) * 6.2831853f;
+		float radius = NextFloat(rng) * BENCH_PLAYER_RING;
+		return playerPos + vec2(cos(angle) * radius, sin(angle) * radius);
+	}
+	case SceneLayout::Uniform:
+	default:
+		return vec2(NextFloat(rng) * worldSize, NextFloat(rng) * worldSize);
+	}
+}
+
+// One agent count's run: owns the AISystem under test and the scene it works on, which lives in the global registry
+// from construction until the fixture goes away
+class BenchmarkFixture {
+public:
+	BenchmarkFixture(const BenchmarkOptions& options, int agentCount);
+	~BenchmarkFixture() {registry.clear_all_components();}
+
+	// one AI frame with no renderer, then the scene moves on - returns how long the AI frame took
+	int64_t Step();
+
+	AISystem ai;
+};
+
+static void CreateScene(const BenchmarkOptions& options, int agentCount, std::vector<Entity>& decoys) {
+	registry.clear_all_components();
+	uint64_t rng = options.seed;
+
+	float worldSize = sqrt(agentCount * BENCH_AREA_PER_AGENT);
+	vec2 playerPos = vec2(worldSize / 2, worldSize / 2);
+
+	Entity player;
+	registry.players.emplace(player);
+	Motion& playerMotion = registry.motions.emplace(player);
+	playerMotion.position = playerPos;
+	playerMotion.scale = { 1, 1 };
+
+	// extra targets spread over the whole world
+	decoys.clear();
+	for (int i = 0; i < options.decoys; i++) {
+		Entity decoy;
+		Motion& motion = registry.motions.emplace(decoy);
+		motion.position = vec2(NextFloat(rng) * worldSize, NextFloat(rng) * worldSize);
+		motion.scale = { 1, 1 };
+		decoys.push_back(decoy);
+	}
+
+	const AIType types[] = { AIType::Skeleton, AIType::Goblin, AIType::Mushroom, AIType::Bat };
+	std::vector<vec2> swarmCenters;
+	for (int i = 0; i < agentCount; i++) {
+		Entity entity;
+		AIType type = types[i % 4];
+		// swarms are mostly bats in the clustered layout, the other enemies spread out
+		if (options.layout == SceneLayout::Clustered && NextFloat(rng) < 0.7f) type = AIType::Bat;
+
+		Motion& motion = registry.motions.emplace(entity);
+		motion.position = SpawnPosition(options.layout, i, worldSize, playerPos, swarmCenters, rng);
+		motion.velocity = vec2(NextFloat(rng) - 0.5f, NextFloat(rng) - 0.5f) * 100.f;
+		motion.speed = 100;
+		motion.scale = { 1, 1 };
+
+		HasAI& ai = registry.hasAIs.emplace(entity);
+		ai.type = type;
+		ai.detectionRadius = 300;
+
+		Enemy& enemy = registry.enemies.emplace(entity);
+		enemy.attackRadius = 40;
+		enemy.damagePerAttack = 1;
+		enemy.attackCoolDown = 3;
+	}
+}
+
+// stand-in for the physics system so the scene keeps moving between frames
+static void Integrate(float elapsedMs) {
+	for (Entity entity : registry.hasAIs.entities) {
+		Motion& motion = registry.motions.get(entity);
+		motion.position += motion.velocity * (elapsedMs / 1000.f);
+	}
+}
+
+BenchmarkFixture::BenchmarkFixture(const BenchmarkOptions& options, int agentCount) {
+	CreateScene(options, agentCount, ai.decoys);
+	ai.SetRandomSeed(options.seed);
+	ai.parallelAI = options.parallel;
+	ai.batchedLeafTicks = options.batched;
+	ai.fusedBoidUpdate = options.fused;
+	ai.flockBoids = options.flocks;
+	ai.levelOfDetail = options.lod;
+	ai.lodBudgetMs = options.budgetMs;
+	aimath::precision = options.fastMath ? aimath::Precision::Fast : aimath::Precision::Exact;
+}
+
+int64_t BenchmarkFixture::Step() {
+	auto start = std::chrono::steady_clock::now();
+	ai.Step(BENCH_FRAME_MS, nullptr);
+	int64_t stepNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	Integrate(BENCH_FRAME_MS);
+	return stepNs;
+}
+
+static bool ParseArgs(int argc, char* argv[], BenchmarkOptions& options) {
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--layout" && i + 1 < argc) {
+			std::string layout = argv[++i];
+			if (layout == "clustered") options.layout = SceneLayout::Clustered;
+			else if (layout == "uniform") options.layout = SceneLayout::Uniform;
+			else if (layout == "player") options.layout = SceneLayout::AroundPlayer;
+			else return false;
+		} else if (arg == "--frames" && i + 1 < argc) {
+			options.frames = std::max(1, atoi(argv[++i]));
+		} else if (arg == "--seed" && i + 1 < argc) {
+			options.seed = strtoull(argv[++i], nullptr, 10);
+		} else if (arg == "--parallel") {
+			options.parallel = true;
+		} else if (arg == "--batched") {
+			options.batched = true;
+		} else if (arg == "--fused") {
+			options.fused = true;
+		} else if (arg == "--flocks") {
+			options.flocks = true;
+		} else if (arg == "--fast-math") {
+			options.fastMath = true;
+		} else if (arg == "--lod") {
+			options.lod = true;
+		} else if (arg == "--budget" && i + 1 < argc) {
+			options.budgetMs = (float)atof(argv[++i]);
+		} else if (arg == "--decoys" && i + 1 < argc) {
+			options.decoys = std::max(0, atoi(argv[++i]));
+		} else if (atoi(arg.c_str()) > 0) {
+			options.counts.push_back(atoi(arg.c_str()));
+		} else {
+			return false;
+		}
+	}
+	if (options.counts.empty()) {
+		options.counts = { 10, 100, 1000, 10000, 100000 };
+	}
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	BenchmarkOptions options;
+	if (!ParseArgs(argc, argv, options)) {
+		printf("usage: ai_benchmark [--layout clustered|uniform|player] [--frames N] [--seed N] [--parallel] [--batched] [--fused] [--flocks] [--lod] [--budget MS] [--fast-math] [--decoys N] [counts...]\n");
+		return 1;
+	}
+
+	printf("%8s %12s %12s %12s %12s %12s\n", "agents", "total", "sense", "tree", "boids", "attacks");
+	for (int agentCount : options.counts) {
+		BenchmarkFixture fixture(options, agentCount);
+
+		// one warm-up frame so first-time allocations aren't measured
+		fixture.Step();
+		fixture.ai.collectTimings = true;
+		fixture.ai.timings = AIStepTimings();
+
+		double totalNs = 0;
+		for (int frame = 0; frame < options.frames; frame++) {
+			totalNs += (double)fixture.Step();
+		}
+
+		// ns per agent per frame
+		double perAgentFrame = 1.0 / ((double)agentCount * options.frames);
+		const AIStepTimings& t = fixture.ai.timings;
+		printf("%8d %12.1f %12.1f %12.1f %12.1f %12.1f\n", agentCount,
+			totalNs * perAgentFrame,
+			t.senseNs * perAgentFrame,
+			t.treeNs * perAgentFrame,
+			t.boidNs * perAgentFrame,
+			t.attackNs * perAgentFrame);
+	}
+	return 0;
+}
@@ -0,0 +1,74 @@
+// internal
+#include "ai_job_pool.hpp"
+
+AIJobPool::AIJobPool(int workerCount) {
+	for (int i = 0; i < workerCount; i++) {
+		// worker 0 is the caller of Run()
+		workers.emplace_back(&AIJobPool::WorkerLoop, this, i + 1);
+	}
+}
+
+AIJobPool::~AIJobPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+}
+
+void AIJobPool::Run(size_t jobCount, const std::function<void(size_t, int)>& job) {
+	if (jobCount == 0) return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		currentJob = &job;
+		currentJobCount = jobCount;
+		nextJob = 0;
+		generation++;
+	}
+	wake.notify_all();
+
+	Drain(job, jobCount, 0);
+
+	// every job has been claimed, wait for workers still finishing theirs
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [&] { return activeWorkers == 0; });
+	currentJob = nullptr;
+	currentJobCount = 0;
+}
+
+void AIJobPool::WorkerLoop(int workerIndex) {
+	uint64_t seenGeneration = 0;
+	while (true) {
+		const std::function<void(size_t, int)>* job;
+		size_t jobCount;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stopping || generation != seenGeneration; });
+			if (stopping) return;
+			seenGeneration = generation;
+			// woke after the batch was already finished
+			if (!currentJob) continue;
+			job = currentJob;
+			jobCount = currentJobCount;
+			activeWorkers++;
+		}
+
+		Drain(*job, jobCount, workerIndex);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			activeWorkers--;
+		}
+		done.notify_all();
+	}
+}
+
+void AIJobPool::Drain(const std::function<void(size_t, int)>& job, size_t jobCount, int workerIndex) {
+	for (size_t jobIndex = nextJob++; jobIndex < jobCount; jobIndex = nextJob++) {
+		job(jobIndex, workerIndex);
+	}
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+// Small fixed-size thread pool used by the AI system to tick entities in parallel.
+// Run() hands out job indices from a shared atomic counter, so idle workers keep pulling the next chunk
+// until none are left (a simple form of work stealing). The calling thread works too, as worker 0.
+class AIJobPool {
+public:
+	// workerCount extra threads are started; the thread calling Run() is always worker 0
+	explicit AIJobPool(int workerCount);
+	~AIJobPool();
+
+	AIJobPool(const AIJobPool&) = delete;
+	AIJobPool& operator=(const AIJobPool&) = delete;
+
+	// number of distinct worker indices Run() can pass to a job
+	int getWorkerCount() const { return (int)workers.size() + 1; }
+
+	// Calls job(jobIndex, workerIndex) for every jobIndex in [0, jobCount) and blocks until all of them finished
+	void Run(size_t jobCount, const std::function<void(size_t, int)>& job);
+
+private:
+	void WorkerLoop(int workerIndex);
+	void Drain(const std::function<void(size_t, int)>& job, size_t jobCount, int workerIndex);
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	// current batch, only changed under mutex
+	const std::function<void(size_t, int)>* currentJob = nullptr;
+	size_t currentJobCount = 0;
+	uint64_t generation = 0;
+	int activeWorkers = 0;
+	bool stopping = false;
+
+	std::atomic<size_t> nextJob{0};
+};
@@ -0,0 +1,61 @@
+// internal
+#include "ai_math.hpp"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(AI_MATH_SSE)
+#include <xmmintrin.h>
+#endif
+
+namespace aimath {
+	Precision precision = Precision::Exact;
+
+	void DistancesTo(const float* px, const float* py, size_t count, vec2 target, float* distSq, float* invDist) {
+		size_t i = 0;
+		bool fast = precision == Precision::Fast;
+
+#if defined(__AVX__)
+		const __m256 tx = _mm256_set1_ps(target.x), ty = _mm256_set1_ps(target.y);
+		const __m256 half = _mm256_set1_ps(0.5f), threeHalves = _mm256_set1_ps(1.5f), one = _mm256_set1_ps(1.f);
+		for (; i + 8 <= count; i += 8) {
+			__m256 dx = _mm256_sub_ps(tx, _mm256_loadu_ps(px + i));
+			__m256 dy = _mm256_sub_ps(ty, _mm256_loadu_ps(py + i));
+			__m256 d2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+			__m256 inv;
+			if (fast) {
+				inv = _mm256_rsqrt_ps(d2);
+				inv = _mm256_mul_ps(inv, _mm256_sub_ps(threeHalves, _mm256_mul_ps(_mm256_mul_ps(half, d2), _mm256_mul_ps(inv, inv))));
+			} else {
+				inv = _mm256_div_ps(one, _mm256_sqrt_ps(d2));
+			}
+			_mm256_storeu_ps(distSq + i, d2);
+			_mm256_storeu_ps(invDist + i, inv);
+		}
+#endif
+
+#if defined(AI_MATH_SSE)
+		const __m128 tx4 = _mm_set1_ps(target.x), ty4 = _mm_set1_ps(target.y);
+		const __m128 half4 = _mm_set1_ps(0.5f), threeHalves4 = _mm_set1_ps(1.5f), one4 = _mm_set1_ps(1.f);
+		for (; i + 4 <= count; i += 4) {
+			__m128 dx = _mm_sub_ps(tx4, _mm_loadu_ps(px + i));
+			__m128 dy = _mm_sub_ps(ty4, _mm_loadu_ps(py + i));
+			__m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+			__m128 inv;
+			if (fast) {
+				inv = _mm_rsqrt_ps(d2);
+				inv = _mm_mul_ps(inv, _mm_sub_ps(threeHalves4, _mm_mul_ps(_mm_mul_ps(half4, d2), _mm_mul_ps(inv, inv))));
+			} else {
+				inv = _mm_div_ps(one4, _mm_sqrt_ps(d2));
+			}
+			_mm_storeu_ps(distSq + i, d2);
+			_mm_storeu_ps(invDist + i, inv);
+		}
+#endif
+
+		for (; i < count; i++) {
+			float d2 = LengthSq(target.x - px[i], target.y - py[i]);
+			distSq[i] = d2;
+			invDist[i] = InvSqrt(d2);
+		}
+	}
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "common.hpp"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define AI_MATH_SSE 1
+#endif
+
+// Small float geometry helpers shared by the AI code.
+// Radius checks compare squared distances so they need no square root at all, and anything that needs a direction
+// goes through InvLength, whose precision is picked at run time:
+//   Exact - 1 / sqrtf, the same as writing it out
+//   Fast  - the hardware reciprocal square root estimate refined with one Newton step (relative error around 1e-7)
+// DistancesTo does a whole array of agents at once, 8 or 4 at a time with AVX or SSE. ai_math_check.cpp checks all of
+// this against the scalar path and the code it replaced.
+namespace aimath {
+	enum class Precision { Exact, Fast };
+	extern Precision precision;
+
+	inline float LengthSq(float x, float y) {return x * x + y * y;}
+	inline float DistanceSq(vec2 a, vec2 b) {return LengthSq(b.x - a.x, b.y - a.y);}
+
+	// same as distance(a, b) <= radius, radius must not be negative
+	inline bool WithinRadius(vec2 a, vec2 b, float radius) {return DistanceSq(a, b) <= radius * radius;}
+
+	inline float FastInvSqrt(float x) {
+#ifdef AI_MATH_SSE
+		float estimate = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+#else
+		// bit-level first guess, good to a few percent
+		uint32_t bits;
+		memcpy(&bits, &x, sizeof(bits));
+		bits = 0x5f375a86 - (bits >> 1);
+		float estimate;
+		memcpy(&estimate, &bits, sizeof(estimate));
+		estimate = estimate * (1.5f - 0.5f * x * estimate * estimate);
+#endif
+		return estimate * (1.5f - 0.5f * x * estimate * estimate);
+	}
+
+	inline float InvSqrt(float x) {return precision == Precision::Fast ? FastInvSqrt(x) : 1.f / sqrtf(x);}
+	inline float InvLength(float x, float y) {return InvSqrt(LengthSq(x, y));}
+	inline float Length(float x, float y) {
+		float lengthSq = LengthSq(x, y);
+		return precision == Precision::Fast ? lengthSq * FastInvSqrt(lengthSq) : sqrtf(lengthSq);
+	}
+
+	// v scaled to the given length, v must not be zero
+	inline vec2 ScaleTo(vec2 v, float length) {
+		float ratio = length * InvLength(v.x, v.y);
+		return vec2(ratio * v.x, ratio * v.y);
+	}
+
+	// unit vector along v, with very short vectors treated as 0.001 long so nothing divides by zero
+	inline vec2 NormalizeClamped(vec2 v, float minLength = 0.001f) {
+		float lengthSq = LengthSq(v.x, v.y);
+		float invLength = lengthSq > minLength * minLength ? InvSqrt(lengthSq) : 1.f / minLength;
+		return vec2(v.x * invLength, v.y * invLength);
+	}
+
+	// For every i: distSq[i] = |(px[i], py[i]) - target|^2 and invDist[i] = 1 / sqrt(distSq[i]) at the current precision
+	void DistancesTo(const float* px, const float* py, size_t count, vec2 target, float* distSq, float* invDist);
+}
@@ -0,0 +1,184 @@
+// Standalone check for the aimath helpers against the code they replaced.
+// It needs only ai_math.cpp: build the two together and run it once with and once without -mavx to cover both SIMD paths:
+//   - DistancesTo in Exact mode gives the scalar results bit for bit, SIMD lanes and tail alike
+//   - Fast mode stays within FAST_MAX_RELATIVE_ERROR of a double-precision reference
+//   - WithinRadius, NormalizeClamped and ScaleTo agree with the old sqrt(pow(...)) formulas
+// Exits with 1 and prints the first few failures if anything is off.
+//
+// usage: ai_math_check [--seed N] [--cases N]
+
+// internal
+#include "ai_math.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// rsqrt's 12-bit estimate after one Newton step, plus the rounding of the float multiplies
+const double FAST_MAX_RELATIVE_ERROR = 1e-6;
+// the old code worked in double and rounded once, the new code rounds every float step
+const double OLD_MAX_RELATIVE_ERROR = 4e-7;
+const int MAX_REPORTED_FAILURES = 10;
+
+static int failures = 0;
+
+static void Fail(const char* check, size_t index, double expected, double actual) {
+	if (++failures <= MAX_REPORTED_FAILURES) {
+		printf("FAIL %s [%zu]: expected %.9g, got %.9g\n", check, index, expected, actual);
+	}
+}
+
+static bool SameBits(float a, float b) {
+	uint32_t bitsA, bitsB;
+	memcpy(&bitsA, &a, sizeof(bitsA));
+	memcpy(&bitsB, &b, sizeof(bitsB));
+	return bitsA == bitsB;
+}
+
+static double RelativeError(double expected, double actual) {
+	return expected == 0 ? fabs(actual) : fabs(actual - expected) / fabs(expected);
+}
+
+// plain LCG, the cases only have to be the same for the same seed
+static float NextFloat(uint64_t& state, float low, float high) {
+	state = state * 6364136223846793005ull + 1442695040888963407ull;
+	return low + (high - low) * ((float)(state >> 40) / (float)(1ull << 24));
+}
+
+// what AISystem::IsNearby, Normalize and CalculateChaseVector did before aimath
+static bool OldIsNearby(vec2 a, vec2 b, float radius) {
+	float dist = sqrtf(pow((b.x - a.x), 2) + pow((b.y - a.y), 2));
+	return (dist <= radius);
+}
+
+static vec2 OldNormalize(vec2 vector) {
+	float magnitude = sqrt(pow(vector.x, 2) + pow(vector.y, 2));
+	magnitude = std::max(0.001f, magnitude);
+	return vector / vec2(magnitude, magnitude);
+}
+
+static vec2 OldScaleTo(vec2 diff, float speed) {
+	float ratio = speed / sqrt(pow(diff.x, 2) + pow(diff.y, 2));
+	return vec2(ratio * diff.x, ratio * diff.y);
+}
+
+// every count from 0 to 40 so each SIMD width is hit with every tail length, then one large array
+static void CheckDistancesTo(uint64_t& rng) {
+	std::vector<size_t> counts;
+	for (size_t count = 0; count <= 40; count++) counts.push_back(count);
+	counts.push_back(100003);
+
+	double fastWorst = 0;
+	for (size_t count : counts) {
+		std::vector<float> px(count), py(count), distSq(count), invDist(count);
+		vec2 target(NextFloat(rng, -5000, 5000), NextFloat(rng, -5000, 5000));
+		for (size_t i = 0; i < count; i++) {
+			// a mix of far, near and very near points
+			float range = i % 3 == 0 ? 5000.f : i % 3 == 1 ? 50.f : 0.01f;
+			px[i] = target.x + NextFloat(rng, -range, range);
+			py[i] = target.y + NextFloat(rng, -range, range);
+		}
+
+		aimath::precision = aimath::Precision::Exact;
+		aimath::DistancesTo(px.data(), py.data(), count, target, distSq.data(), invDist.data());
+		for (size_t i = 0; i < count; i++) {
+			float d2 = aimath::LengthSq(target.x - px[i], target.y - py[i]);
+			float inv = 1.f / sqrtf(d2);
+			if (!SameBits(distSq[i], d2)) Fail("DistancesTo exact distSq", i, d2, distSq[i]);
+			if (!SameBits(invDist[i], inv)) Fail("DistancesTo exact invDist", i, inv, invDist[i]);
+		}
+
+		aimath::precision = aimath::Precision::Fast;
+		aimath::DistancesTo(px.data(), py.data(), count, target, distSq.data(), invDist.data());
+		for (size_t i = 0; i < count; i++) {
+			double dx = (double)target.x - px[i], dy = (double)target.y - py[i];
+			double reference = 1.0 / sqrt(dx * dx + dy * dy);
+			double error = RelativeError(reference, invDist[i]);
+			fastWorst = std::max(fastWorst, error);
+			if (error > FAST_MAX_RELATIVE_ERROR) Fail("DistancesTo fast invDist", i, reference, invDist[i]);
+		}
+	}
+	aimath::precision = aimath::Precision::Exact;
+	printf("DistancesTo: exact matches scalar, fast worst relative error %.3g (limit %.3g)\n", fastWorst, FAST_MAX_RELATIVE_ERROR);
+}
+
+static void CheckOldFormulas(uint64_t& rng, size_t cases) {
+	vec2 a, b;
+	size_t boundaryCases = 0;
+	double normalizeWorst = 0, scaleWorst = 0;
+
+	for (size_t i = 0; i < cases; i++) {
+		a = vec2(NextFloat(rng, -2000, 2000), NextFloat(rng, -2000, 2000));
+		b = a + vec2(NextFloat(rng, -400, 400), NextFloat(rng, -400, 400));
+		float radius = NextFloat(rng, 0, 500);
+		// points sitting on the radius itself, where rounding decides
+		if (i % 4 == 0) radius = aimath::Length(b.x - a.x, b.y - a.y);
+
+		// the old and new comparisons may round differently only for a point within a float step of the radius
+		bool expected = OldIsNearby(a, b, radius);
+		bool actual = aimath::WithinRadius(a, b, radius);
+		double dist = sqrt(aimath::DistanceSq(a, b));
+		if (expected != actual) {
+			if (RelativeError(radius, dist) <= OLD_MAX_RELATIVE_ERROR) boundaryCases++;
+			else Fail("WithinRadius", i, expected, actual);
+		}
+
+		// includes vectors shorter than the 0.001 clamp
+		vec2 v(NextFloat(rng, -1, 1), NextFloat(rng, -1, 1));
+		v *= i % 5 == 0 ? 0.0004f : i % 5 == 1 ? 1.f : 300.f;
+		vec2 oldNormal = OldNormalize(v), newNormal = aimath::NormalizeClamped(v);
+		double normalizeError = std::max(RelativeError(oldNormal.x, newNormal.x), RelativeError(oldNormal.y, newNormal.y));
+		normalizeWorst = std::max(normalizeWorst, normalizeError);
+		if (normalizeError > OLD_MAX_RELATIVE_ERROR) Fail("NormalizeClamped", i, oldNormal.x, newNormal.x);
+
+		vec2 diff = b - a;
+		if (diff.x == 0 && diff.y == 0) continue;
+		float speed = NextFloat(rng, 0, 300);
+		vec2 oldScaled = OldScaleTo(diff, speed), newScaled = aimath::ScaleTo(diff, speed);
+		double scaleError = std::max(RelativeError(oldScaled.x, newScaled.x), RelativeError(oldScaled.y, newScaled.y));
+		scaleWorst = std::max(scaleWorst, scaleError);
+		if (scaleError > OLD_MAX_RELATIVE_ERROR) Fail("ScaleTo", i, oldScaled.x, newScaled.x);
+	}
+
+	printf("WithinRadius: same as sqrt(pow(...)) apart from %zu points within rounding of the radius\n", boundaryCases);
+	printf("NormalizeClamped: worst relative error %.3g, ScaleTo: %.3g (limit %.3g)\n", normalizeWorst, scaleWorst, OLD_MAX_RELATIVE_ERROR);
+}
+
+int main(int argc, char* argv[]) {
+	uint64_t seed = 1;
+	size_t cases = 1000000;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--seed" && i + 1 < argc) {
+			seed = strtoull(argv[++i], nullptr, 10);
+		} else if (arg == "--cases" && i + 1 < argc) {
+			cases = strtoull(argv[++i], nullptr, 10);
+		} else {
+			printf("usage: ai_math_check [--seed N] [--cases N]\n");
+			return 1;
+		}
+	}
+
+#if defined(__AVX__)
+	printf("SIMD path: AVX with SSE and scalar tails\n");
+#elif defined(AI_MATH_SSE)
+	printf("SIMD path: SSE with a scalar tail\n");
+#else
+	printf("SIMD path: none, scalar only\n");
+#endif
+
+	uint64_t rng = seed;
+	CheckDistancesTo(rng);
+	CheckOldFormulas(rng, cases);
+
+	if (failures > 0) {
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,287 @@
+// internal
+#include "ai_navigation.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+
+void NavGrid::Resize(int newWidth, int newHeight, float newTileSize, vec2 newOrigin) {
+	width = std::max(0, newWidth);
+	height = std::max(0, newHeight);
+	tileSize = newTileSize;
+	origin = newOrigin;
+	blocked.assign((size_t)width * height, 0);
+	version++;
+}
+
+void NavGrid::SetBlocked(int x, int y, bool isBlocked) {
+	if (!InBounds(x, y) || blocked[y * width + x] == (uint8_t)isBlocked) return;
+	blocked[y * width + x] = isBlocked;
+	version++;
+}
+
+bool NavGrid::TileAt(vec2 position, int& x, int& y) const {
+	x = (int)std::floor((position.x - origin.x) / tileSize);
+	y = (int)std::floor((position.y - origin.y) / tileSize);
+	return InBounds(x, y);
+}
+
+vec2 NavGrid::TileCenter(int x, int y) const {
+	return vec2(origin.x + (x + 0.5f) * tileSize, origin.y + (y + 0.5f) * tileSize);
+}
+
+bool NavGrid::LineOfSight(int x0, int y0, int x1, int y1) const {
+	// Bresenham from one tile to the other
+	int dx = std::abs(x1 - x0), dy = -std::abs(y1 - y0);
+	int stepX = x0 < x1 ? 1 : -1, stepY = y0 < y1 ? 1 : -1;
+	int error = dx + dy;
+	int x = x0, y = y0;
+	while (x != x1 || y != y1) {
+		int doubled = 2 * error;
+		if (doubled >= dy) { error += dy; x += stepX; }
+		if (doubled <= dx) { error += dx; y += stepY; }
+		if ((x != x1 || y != y1) && IsBlocked(x, y)) return false;
+	}
+	return true;
+}
+
+const uint32_t NO_PATH = UINT32_MAX;
+const uint32_t STRAIGHT_COST = 10;
+const uint32_t DIAGONAL_COST = 14;
+const int NEIGHBOR_DX[8] = { 1, -1, 0, 0, 1, 1, -1, -1 };
+const int NEIGHBOR_DY[8] = { 0, 0, 1, -1, 1, -1, 1, -1 };
+
+// a diagonal step is only allowed when both tiles it squeezes between are open
+static bool CanStep(const NavGrid& grid, int x, int y, int dx, int dy) {
+	if (grid.IsBlocked(x + dx, y + dy)) return false;
+	return dx == 0 || dy == 0 || (!grid.IsBlocked(x + dx, y) && !grid.IsBlocked(x, y + dy));
+}
+
+bool FlowField::Update(const NavGrid& navGrid, vec2 goal) {
+	int x, y;
+	if (!navGrid.TileAt(goal, x, y)) {
+		x = -1;
+		y = -1;
+	}
+	if (grid == &navGrid && x == goalX && y == goalY && gridVersion == navGrid.getVersion()) return false;
+	grid = &navGrid;
+	goalX = x;
+	goalY = y;
+	gridVersion = navGrid.getVersion();
+
+	int width = navGrid.getWidth();
+	size_t tileCount = (size_t)width * navGrid.getHeight();
+	cost.assign(tileCount, NO_PATH);
+	direction.assign(tileCount, vec2(0, 0));
+	if (goalX < 0 || navGrid.IsBlocked(goalX, goalY)) return true;
+
+	// Dijkstra outward from the goal
+	auto heapOrder = std::greater<std::pair<uint32_t, int>>();
+	heap.clear();
+	cost[goalY * width + goalX] = 0;
+	heap.push_back({ 0, goalY * width + goalX });
+	while (!heap.empty()) {
+		std::pop_heap(heap.begin(), heap.end(), heapOrder);
+		std::pair<uint32_t, int> top = heap.back();
+		heap.pop_back();
+		if (top.first != cost[top.second]) continue;  // already reached more cheaply
+
+		int tx = top.second % width;
+		int ty = top.second / width;
+		for (int n = 0; n < 8; n++) {
+			int dx = NEIGHBOR_DX[n], dy = NEIGHBOR_DY[n];
+			if (!CanStep(navGrid, tx, ty, dx, dy)) continue;
+			uint32_t next = top.first + (dx != 0 && dy != 0 ? DIAGONAL_COST : STRAIGHT_COST);
+			int neighbor = (ty + dy) * width + tx + dx;
+			if (next < cost[neighbor]) {
+				cost[neighbor] = next;
+				heap.push_back({ next, neighbor });
+				std::push_heap(heap.begin(), heap.end(), heapOrder);
+			}
+		}
+	}
+
+	// each tile points at its cheapest neighbour, so looking a direction up later is a single read
+	for (int ty = 0; ty < navGrid.getHeight(); ty++) {
+		for (int tx = 0; tx < width; tx++) {
+			int tile = ty * width + tx;
+			if (cost[tile] == NO_PATH || cost[tile] == 0) continue;
+			uint32_t best = cost[tile];
+			for (int n = 0; n < 8; n++) {
+				int dx = NEIGHBOR_DX[n], dy = NEIGHBOR_DY[n];
+				if (!CanStep(navGrid, tx, ty, dx, dy)) continue;
+				uint32_t neighborCost = cost[(ty + dy) * width + tx + dx];
+				if (neighborCost < best) {
+					best = neighborCost;
+					float invLength = dx != 0 && dy != 0 ? 0.70710678f : 1.f;
+					direction[tile] = vec2(dx * invLength, dy * invLength);
+				}
+			}
+		}
+	}
+	return true;
+}
+
+vec2 FlowField::DirectionAt(vec2 position) const {
+	int x, y;
+	if (!grid || !grid->TileAt(position, x, y)) return vec2(0, 0);
+	return direction[y * grid->getWidth() + x];
+}
+
+void WallDistanceField::Build(const NavGrid& navGrid) {
+	grid = &navGrid;
+	nearest.assign((size_t)navGrid.getWidth() * navGrid.getHeight(), -1);
+	hasWalls = false;
+	for (int y = 0; y < navGrid.getHeight() && !hasWalls; y++) {
+		for (int x = 0; x < navGrid.getWidth() && !hasWalls; x++) {
+			hasWalls = navGrid.IsBlocked(x, y);
+		}
+	}
+	if (!hasWalls) return;
+	Spread(true);
+	Spread(false);
+}
+
+// multi-source BFS from every wall tile (or every open tile), each tile of the other kind keeps the source that reached it first
+void WallDistanceField::Spread(bool fromWalls) {
+	int width = grid->getWidth();
+	int height = grid->getHeight();
+	std::vector<int> source((size_t)width * height, -1);
+	queue.clear();
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			if (grid->IsBlocked(x, y) != fromWalls) continue;
+			source[y * width + x] = y * width + x;
+			queue.push_back(y * width + x);
+		}
+	}
+
+	for (size_t head = 0; head < queue.size(); head++) {
+		int tile = queue[head];
+		int x = tile % width;
+		int y = tile / width;
+		for (int n = 0; n < 8; n++) {
+			int nx = x + NEIGHBOR_DX[n], ny = y + NEIGHBOR_DY[n];
+			if (!grid->InBounds(nx, ny) || source[ny * width + nx] >= 0) continue;
+			source[ny * width + nx] = source[tile];
+			queue.push_back(ny * width + nx);
+		}
+	}
+
+	for (int tile = 0; tile < width * height; tile++) {
+		if (grid->IsBlocked(tile % width, tile / width) != fromWalls) nearest[tile] = source[tile];
+	}
+}
+
+static vec2 ClosestPoint(vec2 position, vec2 min, vec2 max) {
+	return vec2(std::min(std::max(position.x, min.x), max.x), std::min(std::max(position.y, min.y), max.y));
+}
+
+// distance from position to target and the unit direction between them, towards fallback when the two are the same point
+static float DirectionTo(vec2 position, vec2 target, vec2 fallback, vec2& direction) {
+	float dx = target.x - position.x, dy = target.y - position.y;
+	float distance = std::sqrt(dx * dx + dy * dy);
+	if (distance == 0) {
+		dx = fallback.x - position.x;
+		dy = fallback.y - position.y;
+		float fallbackDistance = std::sqrt(dx * dx + dy * dy);
+		direction = fallbackDistance > 0 ? vec2(dx / fallbackDistance, dy / fallbackDistance) : vec2(0, 0);
+		return 0;
+	}
+	direction = vec2(dx / distance, dy / distance);
+	return distance;
+}
+
+// Distance and direction to the closest tile of the other kind (wall or open) to the one at x, y. The BFS can be a
+// tile off along diagonals, so the tiles its neighbours found (and the neighbours themselves) are tried as well.
+float WallDistanceField::DistanceToOther(int x, int y, vec2 position, vec2& direction) const {
+	int width = grid->getWidth();
+	float tileSize = grid->getTileSize();
+	vec2 origin = grid->getOrigin();
+	bool blocked = grid->IsBlocked(x, y);
+	float best = INFINITY;
+	direction = vec2(0, 0);
+	for (int ny = y - 1; ny <= y + 1; ny++) {
+		for (int nx = x - 1; nx <= x + 1; nx++) {
+			if (!grid->InBounds(nx, ny)) continue;
+			int candidate = grid->IsBlocked(nx, ny) != blocked ? ny * width + nx : nearest[ny * width + nx];
+			if (candidate < 0) continue;
+			int cx = candidate % width, cy = candidate / width;
+			vec2 tileMin = vec2(origin.x + cx * tileSize, origin.y + cy * tileSize);
+			vec2 closest = ClosestPoint(position, tileMin, tileMin + vec2(tileSize, tileSize));
+			vec2 candidateDirection;
+			float candidateDistance = DirectionTo(position, closest, grid->TileCenter(cx, cy), candidateDirection);
+			if (candidateDistance < best) {
+				best = candidateDistance;
+				direction = candidateDirection;
+			}
+		}
+	}
+	return best;
+}
+
+void WallDistanceField::Sample(vec2 position, float& distance, vec2& normal) const {
+	float tileSize = grid->getTileSize();
+	int width = grid->getWidth();
+	vec2 origin = grid->getOrigin();
+	vec2 end = vec2(origin.x + width * tileSize, origin.y + grid->getHeight() * tileSize);
+
+	int x, y;
+	if (!grid->TileAt(position, x, y)) {
+		// off the grid is inside the walls, the way out is back onto it
+		vec2 closest = ClosestPoint(position, origin, end);
+		distance = -DirectionTo(position, closest, (origin + end) * 0.5f, normal);
+		return;
+	}
+
+	if (grid->IsBlocked(x, y)) {
+		// -INFINITY and no normal on a level that is nothing but wall
+		distance = -DistanceToOther(x, y, position, normal);
+		return;
+	}
+
+	// the grid's edges count as walls
+	distance = position.x - origin.x;
+	normal = vec2(1, 0);
+	if (end.x - position.x < distance) { distance = end.x - position.x; normal = vec2(-1, 0); }
+	if (position.y - origin.y < distance) { distance = position.y - origin.y; normal = vec2(0, 1); }
+	if (end.y - position.y < distance) { distance = end.y - position.y; normal = vec2(0, -1); }
+
+	vec2 towardWall;
+	float wallDistance = DistanceToOther(x, y, position, towardWall);
+	if (wallDistance < distance) {
+		distance = wallDistance;
+		normal = -towardWall;
+	}
+}
+
+bool VisibilityGrid::Update(const NavGrid& navGrid, vec2 target) {
+	int x, y;
+	if (!navGrid.TileAt(target, x, y)) {
+		x = -1;
+		y = -1;
+	}
+	if (grid == &navGrid && x == targetX && y == targetY && gridVersion == navGrid.getVersion()) return false;
+	grid = &navGrid;
+	targetX = x;
+	targetY = y;
+	gridVersion = navGrid.getVersion();
+
+	int width = navGrid.getWidth();
+	int height = navGrid.getHeight();
+	visible.assign((size_t)width * height, 1);
+	if (targetX < 0) return true;
+	for (int ty = 0; ty < height; ty++) {
+		for (int tx = 0; tx < width; tx++) {
+			visible[ty * width + tx] = navGrid.LineOfSight(tx, ty, targetX, targetY);
+		}
+	}
+	return true;
+}
+
+bool VisibilityGrid::Visible(vec2 position) const {
+	int x, y;
+	if (!grid || !grid->TileAt(position, x, y)) return true;
+	return visible[y * grid->getWidth() + x] != 0;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <utility>
+
+#include "common.hpp"
+
+// Walkable tiles of the current level. Every tile is open until the level code marks walls with SetBlocked
+// (see AISystem::LoadLevel).
+// version changes on every edit so anything derived from the grid knows to rebuild.
+class NavGrid {
+public:
+	void Resize(int width, int height, float tileSize, vec2 origin = { 0, 0 });
+	void SetBlocked(int x, int y, bool blocked);
+
+	bool InBounds(int x, int y) const {return x >= 0 && y >= 0 && x < width && y < height;}
+	// out of bounds counts as blocked
+	bool IsBlocked(int x, int y) const {return !InBounds(x, y) || blocked[y * width + x];}
+	// false if the position is off the grid
+	bool TileAt(vec2 position, int& x, int& y) const;
+	vec2 TileCenter(int x, int y) const;
+	// true when the line between the two tiles' centres crosses no blocked tile, the two end tiles aside
+	bool LineOfSight(int x0, int y0, int x1, int y1) const;
+
+	bool empty() const {return width == 0 || height == 0;}
+	int getWidth() const {return width;}
+	int getHeight() const {return height;}
+	float getTileSize() const {return tileSize;}
+	vec2 getOrigin() const {return origin;}
+	uint32_t getVersion() const {return version;}
+
+private:
+	int width = 0;
+	int height = 0;
+	float tileSize = 1;
+	vec2 origin = { 0, 0 };
+	std::vector<uint8_t> blocked;
+	uint32_t version = 0;
+};
+
+// Shortest path distance from every tile to one goal tile (8-way moves, no cutting past blocked corners), plus the
+// direction to move in from each tile. Built once per goal tile and shared by every agent heading for that goal, so an
+// agent's steering is a single lookup however many agents there are.
+// Every rebuild starts from scratch: moving the goal one tile changes the distance of every tile, so there is nothing
+// to patch, and it only happens when the target crosses into another tile or a wall tile changes - a few times a
+// second at most, against one Dijkstra pass over a level-sized grid.
+class FlowField {
+public:
+	// Rebuilds only when the goal moved to another tile or the grid changed, returns true if it rebuilt
+	bool Update(const NavGrid& grid, vec2 goal);
+
+	// Unit direction to move in from position. (0, 0) in the goal tile, off the grid and where the goal can't be reached,
+	// callers steer straight at the goal then.
+	vec2 DirectionAt(vec2 position) const;
+
+private:
+	const NavGrid* grid = nullptr;
+	int goalX = -1;
+	int goalY = -1;
+	uint32_t gridVersion = 0;
+	std::vector<uint32_t> cost;     // per tile, in tenths of a tile (straight 10, diagonal 14)
+	std::vector<vec2> direction;   // per tile
+	std::vector<std::pair<uint32_t, int>> heap;
+};
+
+// Signed distance from any point to the level's walls, and the unit normal pointing out of them. Positive in the open
+// (the distance to the nearest wall tile or grid edge), negative inside a wall tile or off the grid (how far it is
+// out to open floor). Each open tile keeps the wall tile closest to it and each wall tile the open tile closest to it,
+// found with a multi-source BFS when the level loads. Sampling a point works out the exact distance to the squares
+// kept by its tile and the tiles around it.
+class WallDistanceField {
+public:
+	// from scratch, call whenever the grid's walls change
+	void Build(const NavGrid& grid);
+
+	// false until a grid with at least one wall tile has been built
+	bool HasWalls() const {return hasWalls;}
+	// only once HasWalls - normal is (0, 0) only on a level with no open floor at all
+	void Sample(vec2 position, float& distance, vec2& normal) const;
+
+private:
+	const NavGrid* grid = nullptr;
+	bool hasWalls = false;
+	std::vector<int> nearest;  // per tile: the closest tile of the other kind, -1 when there is none
+	std::vector<int> queue;
+	void Spread(bool fromWalls);
+	float DistanceToOther(int x, int y, vec2 position, vec2& direction) const;
+};
+
+// Which tiles can see one target tile, by NavGrid::LineOfSight from each tile's centre. Rebuilt only when the target
+// moves to another tile or the grid changes, so checking whether an agent can see the target is a single lookup.
+class VisibilityGrid {
+public:
+	// Rebuilds only when the target moved to another tile or the grid changed, returns true if it rebuilt
+	bool Update(const NavGrid& grid, vec2 target);
+
+	// true off the grid, and everywhere while the target is off it
+	bool Visible(vec2 position) const;
+
+private:
+	const NavGrid* grid = nullptr;
+	int targetX = -1;
+	int targetY = -1;
+	uint32_t gridVersion = 0;
+	std::vector<uint8_t> visible;  // per tile
+};
@@ -0,0 +1,74 @@
+// internal
+#include "ai_profiler.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+
+AIProfiler& AIProfiler::get() {
+	// large, so it lives in static storage rather than on anyone's stack
+	static AIProfiler profiler;
+	return profiler;
+}
+
+int64_t AIProfiler::NowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// small stable id per thread for the trace's tid column
+static uint32_t ThreadIndex() {
+	static std::atomic<uint32_t> nextThread{0};
+	thread_local uint32_t index = nextThread++;
+	return index;
+}
+
+void AIProfiler::RecordEvent(const char* name, int64_t startNs, int64_t durationNs) {
+	uint64_t slot = eventCount.fetch_add(1, std::memory_order_relaxed);
+	events[slot % EVENT_CAPACITY] = { name, startNs, durationNs, ThreadIndex() };
+}
+
+void AIProfiler::EndFrame() {
+	Frame& frame = frames[frameCount % FRAME_CAPACITY];
+	frame.endNs = NowNs();
+	frame.nodesVisited = counters.nodesVisited.exchange(0);
+	frame.neighborPairsTested = counters.neighborPairsTested.exchange(0);
+	frame.isNearbyCalls = counters.isNearbyCalls.exchange(0);
+	frame.registryInserts = counters.registryInserts.exchange(0);
+	frame.registryRemoves = counters.registryRemoves.exchange(0);
+	frameCount++;
+}
+
+bool AIProfiler::DumpChromeTrace(const std::string& path) const {
+	FILE* file = fopen(path.c_str(), "w");
+	if (!file) {
+		printf("ERROR could not write AI trace %s\n", path.c_str());
+		return false;
+	}
+
+	fprintf(file, "{\"traceEvents\":[\n");
+	bool first = true;
+
+	uint64_t eventTotal = eventCount.load();
+	for (uint64_t i = eventTotal - std::min<uint64_t>(eventTotal, EVENT_CAPACITY); i < eventTotal; i++) {
+		const Event& event = events[i % EVENT_CAPACITY];
+		// chrome traces are in microseconds
+		fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+			first ? "" : ",\n", event.name, event.thread, event.startNs / 1000.0, event.durationNs / 1000.0);
+		first = false;
+	}
+
+	for (uint64_t i = frameCount - std::min<uint64_t>(frameCount, FRAME_CAPACITY); i < frameCount; i++) {
+		const Frame& frame = frames[i % FRAME_CAPACITY];
+		fprintf(file, "%s{\"name\":\"AI counters\",\"ph\":\"C\",\"pid\":0,\"ts\":%.3f,\"args\":{"
+			"\"nodesVisited\":%llu,\"neighborPairsTested\":%llu,\"isNearbyCalls\":%llu,\"registryInserts\":%llu,\"registryRemoves\":%llu}}",
+			first ? "" : ",\n", frame.endNs / 1000.0,
+			(unsigned long long)frame.nodesVisited, (unsigned long long)frame.neighborPairsTested,
+			(unsigned long long)frame.isNearbyCalls, (unsigned long long)frame.registryInserts,
+			(unsigned long long)frame.registryRemoves);
+		first = false;
+	}
+
+	fprintf(file, "\n]}\n");
+	fclose(file);
+	return true;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <string>
+
+// Hot-path instrumentation for the AI system, switched on at compile time with AI_PROFILING.
+// Scoped timers and per-frame counters are written into fixed-size ring buffers, and DumpChromeTrace writes them out
+// as a Chrome trace (chrome://tracing or ui.perfetto.dev). Without AI_PROFILING every macro expands to nothing.
+//
+//   AI_PROFILE_SCOPE("MoveBoid");              // timer from here to the end of the enclosing scope
+//   AI_PROFILE_COUNT(neighborPairsTested, n);  // adds n to this frame's counter
+//   AI_PROFILE_FRAME();                        // closes the frame's counters, once per Step
+
+struct AIProfileCounters {
+	std::atomic<uint64_t> nodesVisited{0};
+	std::atomic<uint64_t> neighborPairsTested{0};
+	std::atomic<uint64_t> isNearbyCalls{0};
+	std::atomic<uint64_t> registryInserts{0};
+	std::atomic<uint64_t> registryRemoves{0};
+};
+
+class AIProfiler {
+public:
+	static const uint32_t EVENT_CAPACITY = 1 << 16;
+	static const uint32_t FRAME_CAPACITY = 1 << 10;
+
+	struct Event {
+		const char* name;
+		int64_t startNs;
+		int64_t durationNs;
+		uint32_t thread;
+	};
+
+	struct Frame {
+		int64_t endNs;
+		uint64_t nodesVisited;
+		uint64_t neighborPairsTested;
+		uint64_t isNearbyCalls;
+		uint64_t registryInserts;
+		uint64_t registryRemoves;
+	};
+
+	static AIProfiler& get();
+
+	AIProfileCounters counters;
+
+	void RecordEvent(const char* name, int64_t startNs, int64_t durationNs);
+	// snapshots and resets the counters
+	void EndFrame();
+	bool DumpChromeTrace(const std::string& path) const;
+
+	static int64_t NowNs();
+
+private:
+	// ring buffers, the oldest entries are overwritten once full
+	Event events[EVENT_CAPACITY];
+	Frame frames[FRAME_CAPACITY];
+	std::atomic<uint64_t> eventCount{0};
+	uint64_t frameCount = 0;
+};
+
+class AIProfileScope {
+public:
+	explicit AIProfileScope(const char* name) : name(name), startNs(AIProfiler::NowNs()) {}
+	~AIProfileScope() { AIProfiler::get().RecordEvent(name, startNs, AIProfiler::NowNs() - startNs); }
+
+private:
+	const char* name;
+	int64_t startNs;
+};
+
+#ifdef AI_PROFILING
+#define AI_PROFILE_CONCAT_INNER(a, b) a##b
+#define AI_PROFILE_CONCAT(a, b) AI_PROFILE_CONCAT_INNER(a, b)
+#define AI_PROFILE_SCOPE(name) AIProfileScope AI_PROFILE_CONCAT(aiProfileScope, __LINE__)(name)
+#define AI_PROFILE_COUNT(counter, n) (AIProfiler::get().counters.counter.fetch_add((uint64_t)(n), std::memory_order_relaxed))
+#define AI_PROFILE_FRAME() AIProfiler::get().EndFrame()
+#else
+#define AI_PROFILE_SCOPE(name) ((void)0)
+#define AI_PROFILE_COUNT(counter, n) ((void)0)
+#define AI_PROFILE_FRAME() ((void)0)
+#endif
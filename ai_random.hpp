@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Counter-based random numbers for the AI.
+// Every roll is a pure function of (seed, entity id, frame, stream), so there is no generator state to keep per agent,
+// rolls don't depend on the order agents are ticked in (or which thread ticks them), and the same seed replays the same game.
+class AIRandom {
+public:
+	explicit AIRandom(uint64_t seed = 0) : seed(seed), seedKey(Mix(seed)) {}
+
+	void setSeed(uint64_t newSeed) { seed = newSeed; seedKey = Mix(newSeed); }
+	uint64_t getSeed() const { return seed; }
+
+	// 64 random bits for one agent on one frame; stream separates independent rolls made on the same frame
+	uint64_t Next(uint32_t entityId, uint32_t frame, uint32_t stream) const {
+		uint64_t counter = ((uint64_t)entityId << 32) | frame;
+		// the seed is hashed on its own - xoring it into the counter would only move seed 0's rolls between (id, frame) pairs
+		return Mix((Mix(counter) ^ seedKey) + stream);
+	}
+
+	// uniform int in [min, max]
+	int Range(uint32_t entityId, uint32_t frame, uint32_t stream, int min, int max) const {
+		uint64_t span = (uint64_t)(max - min) + 1;
+		// multiply-shift instead of modulo - the bias is far below anything a 1-1000 roll could notice
+		return min + (int)(((Next(entityId, frame, stream) >> 32) * span) >> 32);
+	}
+
+	// Fills the two 1-1000 rolls AIStatus uses (rand, rand2) for a whole batch of agents
+	void FillRolls(const uint32_t* entityIds, size_t count, uint32_t frame, int* rand, int* rand2) const {
+		for (size_t i = 0; i < count; i++) {
+			rand[i] = Range(entityIds[i], frame, 0, 1, 1000);
+			rand2[i] = Range(entityIds[i], frame, 1, 1, 1000);
+		}
+	}
+
+private:
+	// splitmix64 finalizer
+	static uint64_t Mix(uint64_t x) {
+		x += 0x9E3779B97F4A7C15ull;
+		x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+		x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+		return x ^ (x >> 31);
+	}
+
+	uint64_t seed;
+	uint64_t seedKey;  // Mix(seed)
+};
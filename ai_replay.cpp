@@ -0,0 +1,100 @@
+// internal
+#include "ai_replay.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+const char REPLAY_MAGIC[4] = { 'W', 'A', 'I', 'R' };
+const uint32_t REPLAY_VERSION = 4;
+
+template <typename T>
+static void Write(std::ofstream& out, const T& value) {
+	out.write((const char*)&value, sizeof(T));
+}
+
+template <typename T>
+static bool Read(std::ifstream& in, T& value) {
+	return (bool)in.read((char*)&value, sizeof(T));
+}
+
+bool AIRecorder::Open(const std::string& path, uint64_t seed) {
+	out.open(path, std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) {
+		printf("ERROR could not open AI recording %s\n", path.c_str());
+		return false;
+	}
+	out.write(REPLAY_MAGIC, sizeof(REPLAY_MAGIC));
+	Write(out, REPLAY_VERSION);
+	Write(out, seed);
+	return true;
+}
+
+void AIRecorder::Close() {
+	if (out.is_open()) out.close();
+}
+
+void AIRecorder::WriteFrame(const AIFrameRecord& frame) {
+	Write(out, frame.frameIndex);
+	Write(out, frame.elapsedMs);
+	Write(out, frame.aiTimeMs);
+	Write(out, (uint32_t)frame.targets.size());
+	for (const AITargetRecord& target : frame.targets) {
+		Write(out, target.player);
+		Write(out, target.dying);
+		Write(out, target.position);
+		Write(out, target.velocity);
+		Write(out, target.speed);
+	}
+	Write(out, (uint32_t)frame.agents.size());
+	for (const AIAgentRecord& agent : frame.agents) {
+		Write(out, agent.id);
+		Write(out, agent.type);
+		Write(out, agent.cursor);
+		Write(out, agent.attacking);
+		Write(out, agent.taskStep);
+		Write(out, agent.taskWakeMs);
+		Write(out, agent.cooldownEndMs);
+		Write(out, agent.position);
+		Write(out, agent.velocity);
+		Write(out, agent.speed);
+		Write(out, agent.detectionRadius);
+		Write(out, agent.attackRadius);
+		Write(out, agent.attackCooldown);
+	}
+	Write(out, frame.hash);
+}
+
+bool AIReplayReader::Open(const std::string& path) {
+	in.open(path, std::ios::binary);
+	char magic[4];
+	uint32_t version;
+	if (!in.is_open() || !in.read(magic, sizeof(magic)) || !std::equal(magic, magic + 4, REPLAY_MAGIC)
+		|| !Read(in, version) || version != REPLAY_VERSION || !Read(in, seed)) {
+		printf("ERROR %s is not a valid AI recording\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool AIReplayReader::ReadFrame(AIFrameRecord& frame) {
+	uint32_t targetCount, agentCount;
+	if (!Read(in, frame.frameIndex) || !Read(in, frame.elapsedMs) || !Read(in, frame.aiTimeMs) || !Read(in, targetCount)) {
+		return false;
+	}
+	frame.targets.resize(targetCount);
+	for (AITargetRecord& target : frame.targets) {
+		bool ok = Read(in, target.player) && Read(in, target.dying) && Read(in, target.position)
+			&& Read(in, target.velocity) && Read(in, target.speed);
+		if (!ok) return false;
+	}
+	if (!Read(in, agentCount)) return false;
+	frame.agents.resize(agentCount);
+	for (AIAgentRecord& agent : frame.agents) {
+		bool ok = Read(in, agent.id) && Read(in, agent.type) && Read(in, agent.cursor) && Read(in, agent.attacking)
+			&& Read(in, agent.taskStep) && Read(in, agent.taskWakeMs) && Read(in, agent.cooldownEndMs)
+			&& Read(in, agent.position) && Read(in, agent.velocity) && Read(in, agent.speed)
+			&& Read(in, agent.detectionRadius) && Read(in, agent.attackRadius) && Read(in, agent.attackCooldown);
+		if (!ok) return false;
+	}
+	return Read(in, frame.hash);
+}
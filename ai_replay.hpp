@@ -0,0 +1,89 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdint>
+
+#include "common.hpp"
+
+// Record/replay of AI inputs, used to reproduce AI bugs and to check optimized AI paths against the reference one.
+// A recording is a small header (magic, version, seed) followed by one AIFrameRecord per Step. Each frame stores
+// everything the AI reads plus a hash of what it produced, so a replay can flag the first frame that diverges.
+
+// One AI entity at the start of a frame. id is the entity id at record time - replays key their rolls on it
+struct AIAgentRecord {
+	uint32_t id;
+	uint8_t type;
+	uint8_t cursor;     // BehaviorState::currentNode
+	uint8_t attacking;  // AttackPlayer wanted to attack (BehaviorState::wantsAttack)
+	// where the timed leaves had got (BehaviorState::taskStep, taskWakeMs and cooldownEndMs) - the task itself isn't
+	// recorded, the replay starts a new one from these
+	uint32_t taskStep;
+	double taskWakeMs;
+	double cooldownEndMs;
+	vec2 position;
+	vec2 velocity;
+	float speed;
+	float detectionRadius;
+	float attackRadius;
+	float attackCooldown;
+};
+
+// One player or decoy, in the order AITargetTable::Build sees them (every player, then AISystem::decoys)
+struct AITargetRecord {
+	uint8_t player;  // 0 for a decoy
+	uint8_t dying;   // had a DeathTimer, so enemies leave it alone
+	vec2 position;
+	vec2 velocity;
+	float speed;
+};
+
+struct AIFrameRecord {
+	uint32_t frameIndex = 0;
+	float elapsedMs = 0;
+	double aiTimeMs = 0;  // the AI clock before this frame, what the task wake times above are on
+	std::vector<AITargetRecord> targets;
+	std::vector<AIAgentRecord> agents;
+	// hash of every agent's velocity, cursor and task progress plus the set of agents wanting to attack after the AI ran
+	uint64_t hash = 0;
+};
+
+struct AIReplayResult {
+	bool loaded = false;
+	uint32_t frames = 0;
+	int64_t firstMismatch = -1;  // frame index of the first hash mismatch, -1 if the replay matched
+};
+
+// FNV-1a, used for the per-frame hash
+inline uint64_t HashBytes(uint64_t hash, const void* data, size_t size) {
+	const uint8_t* bytes = (const uint8_t*)data;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+const uint64_t HASH_SEED = 1469598103934665603ull;
+
+class AIRecorder {
+public:
+	bool Open(const std::string& path, uint64_t seed);
+	void Close();
+	bool IsOpen() const { return out.is_open(); }
+	void WriteFrame(const AIFrameRecord& frame);
+
+private:
+	std::ofstream out;
+};
+
+class AIReplayReader {
+public:
+	bool Open(const std::string& path);
+	uint64_t getSeed() const { return seed; }
+	// false at the end of the stream or on a truncated frame
+	bool ReadFrame(AIFrameRecord& frame);
+
+private:
+	std::ifstream in;
+	uint64_t seed = 0;
+};
@@ -3,121 +3,1177 @@
 #include "world_init.hpp"
 #include "physics_system.hpp"
 #include <algorithm>
+#include <chrono>
 float BOID_GROUPING_RADIUS = 280;
 float BOID_WALL_AVOID_DIST = 40;
+float BOID_SEPARATE_RADIUS = 50;
+// goblins only join in once another enemy is this close to the player
+float GOBLIN_ALLY_RADIUS = 120;
+// PlayerProximity keeps entities up to this far away
+float PLAYER_PROXIMITY_RADIUS = 400;
+// cell size of the target table's grid, about one detection radius
+float TARGET_GRID_CELL_SIZE = 256;
 //ratios
 float BOID_GROUP_RATIO = 1;
 float BOID_SEPERATE_RATIO = 1;
 float BOID_MATCH_RATIO = 1;
 float BOID_CHASE_RATIO = 3;
+// parallel ProcessAI
+const size_t AI_PARALLEL_CHUNK_SIZE = 64;
+const size_t AI_PARALLEL_MIN_ENTITIES = 2 * AI_PARALLEL_CHUNK_SIZE;
+// level of detail tiers, as multiples of each agent's detection radius
+float LOD_NEAR_RATIO = 1.5;
+float LOD_MID_RATIO = 4;
+const uint32_t LOD_MID_INTERVAL = 4;
+const uint32_t LOD_FAR_INTERVAL = 8;
+// distant agents always get at least this many ticks per frame, however tight the budget
+const size_t LOD_MIN_DEFERRED_TICKS = 16;
+// event wakeups - patrollers tick at least this often, and sleep conditions keep this much distance in hand
+const uint32_t WAKE_MAX_SLEEP_FRAMES = 240;
+// flocks are only made of boidGrid cells holding at least this many bats, and never grow past FLOCK_MAX_CELLS cells
+// each way - a bigger flock would be too spread out for its centre to stand in for each bat's neighbours
+const uint32_t FLOCK_MIN_CELL_BATS = 4;
+const int FLOCK_MAX_CELLS = 2;
+float WAKE_DISTANCE_MARGIN = 8;
+float WAKE_BAND_MARGIN = 1;
+
+static int64_t NowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 void AISystem::Step(float elapsedMs, RenderSystem *renderer)
 {
+    AI_PROFILE_SCOPE("AISystem::Step");
+    frameIndex++;
+
+    bool recording = recorder.IsOpen();
+    if (recording) {
+        CaptureFrame(elapsedMs, recordFrame);
+    }
+
+    RunAI(elapsedMs);
+
+    if (recording) {
+        recordFrame.hash = ComputeFrameHash();
+        recorder.WriteFrame(recordFrame);
+    }
+
+    int64_t attackStart = collectTimings ? NowNs() : 0;
+    HandleEnemyAttacks(renderer);
+    if (collectTimings) {
+        timings.attackNs += NowNs() - attackStart;
+        timings.frames++;
+    }
+    AI_PROFILE_FRAME();
+}
+
+// Everything Step does except the attack handling, which needs a renderer - this is the part replays check
+void AISystem::RunAI(float elapsedMs)
+{
+    int64_t senseStart = collectTimings ? NowNs() : 0;
+    if (agents.Sync()) {
+#ifdef AI_COROUTINES
+        // agents that left without OnAIRemoved, or were rebuilt with a new type, took their task slot with them
+        std::vector<int32_t> owners;
+        for (const BehaviorState& behavior : agents.behavior) owners.push_back(behavior.task);
+        taskPool.ReleaseUnowned(owners);
+#endif
+    }
+    DropRetypedState();
     InitializeStatus();
+    // nobody to go after
+    if (targets.empty()) return;
+    status->elapsedMs = elapsedMs;
+    if (useFlowField && !navGrid.empty()) {
+        playerFlowField.Update(navGrid, targets.position(targets.primary));
+    }
+    PruneAttackStates();
+    UpdatePlayerProximity();
+    if (eventWakeups && targets.size() == 1) {
+        UpdateWakeups(elapsedMs);
+    } else if (wakeupsStarted) {
+        ClearWakeups();
+    }
+    aiTimeMs += elapsedMs;
+    status->timeMs = aiTimeMs;
+    status->random = &random;
+#ifdef AI_COROUTINES
+    status->tasks = &taskPool;
+    taskPool.WakeDue(aiTimeMs);
+#endif
+    ScheduleAI(elapsedMs);
+    UpdatePerception();
+
+    bool measureTicks = levelOfDetail && lodBudgetMs > 0;
+    int64_t treeStart = collectTimings || measureTicks ? NowNs() : 0;
+    if (batchedLeafTicks) {
+        ProcessAIBatched();
+    } else if (parallelAI && tickAgents.size() >= AI_PARALLEL_MIN_ENTITIES) {
+        ProcessAIParallel();
+    } else {
+        for (size_t i = 0; i < tickAgents.size(); i++) {
+            ProcessAI(i, status);
+        }
+    }
+
+    int64_t boidStart = collectTimings || measureTicks ? NowNs() : 0;
+    if (measureTicks && !tickAgents.empty()) {
+        double agentNs = (double)(boidStart - treeStart) / tickAgents.size();
+        lodAgentNs = lodAgentNs > 0 ? lodAgentNs * 0.9 + agentNs * 0.1 : agentNs;
+    }
+    if (wakeupsStarted) {
+        SleepIdleAgents();
+    }
+    if (collectTimings) {
+        timings.senseNs += treeStart - senseStart;
+        timings.treeNs += boidStart - treeStart;
+    }
+
+    BuildBoidGrid();
+    if (fusedBoidUpdate || flockBoids) {
+        MoveBoidsFused();
+    } else {
+        for (uint32_t agent : tickAgents) {
+            UpdateEntityMovement(agent);
+        }
+    }
+
+    if (collectTimings) {
+        timings.boidNs += NowNs() - boidStart;
+    }
+}
+
+// Wakes the sleepers whose conditions fired this frame and keeps awakeEntities in step with the registry.
+// Each queue is only popped as far as its due entries, so the cost follows the number of agents that wake.
+void AISystem::UpdateWakeups(float elapsedMs)
+{
+    AI_PROFILE_SCOPE("UpdateWakeups");
+    int player = targets.primary;
+    vec2 playerPos = targets.position(player);
+    if (!wakeupsStarted) {
+        wakeupsStarted = true;
+        lastPlayerPos = playerPos;
+        lastEnemiesEngaging = enemiesEngagingPlayer;
+    }
+    vec2 moved = playerPos - lastPlayerPos;
+    playerTravel += sqrtf(moved.x * moved.x + moved.y * moved.y);
+    lastPlayerPos = playerPos;
 
+    // spawns and deaths - one pass summing ids, the rebuild only happens when the set of AI entities changed
+    uint64_t idSum = 0;
     for (Entity entity : registry.hasAIs.entities) {
-        ProcessAI(entity);
+        idSum += (unsigned int)entity;
+    }
+    if (idSum != trackedAIIdSum || registry.hasAIs.entities.size() != trackedAICount) {
+        for (int i = (int)sleepingAgents.entities.size() - 1; i >= 0; i--) {
+            Entity entity = sleepingAgents.entities[i];
+            if (!registry.hasAIs.has(entity)) sleepingAgents.remove(entity);
+        }
+        awakeEntities.clear();
+        for (Entity entity : registry.hasAIs.entities) {
+            if (!sleepingAgents.has(entity)) awakeEntities.push_back(entity);
+        }
+        trackedAIIdSum = idSum;
+        trackedAICount = registry.hasAIs.entities.size();
     }
 
-    for (Entity entity: registry.hasAIs.entities) {
-        UpdateEntityMovement(entity);
+    // wake times assume the player is no faster than it has been so far
+    float playerSpeed = std::max(targets.speed[player], sqrtf(targets.vx[player] * targets.vx[player] + targets.vy[player] * targets.vy[player]));
+    bool wakeAllPatrol = playerSpeed > wakePlayerSpeed;
+    wakePlayerSpeed = std::max(wakePlayerSpeed, playerSpeed);
+
+    auto wakeDue = [&](WakeQueue& queue, double now) {
+        while (!queue.empty() && queue.top().key <= now) {
+            AIWakeEntry entry = queue.top();
+            queue.pop();
+            if (IsAsleep(entry)) WakeEntity(entry.entity);
+        }
+    };
+    // positions lag the clock by up to a frame, so time based wakeups look one frame ahead
+    wakeDue(wakeOnFrame, wakeAllPatrol ? INFINITY : (double)frameIndex);
+    wakeDue(wakeOnTime, wakeAllPatrol ? INFINITY : aiTimeMs + 2.0 * elapsedMs);
+    wakeDue(wakeOnTravel, playerTravel);
+
+    if (enemiesEngagingPlayer != lastEnemiesEngaging) {
+        for (AIWakeEntry& entry : stalkSleepers) {
+            if (IsAsleep(entry)) WakeEntity(entry.entity);
+        }
+        stalkSleepers.clear();
+        lastEnemiesEngaging = enemiesEngagingPlayer;
+    } else if (stalkSleepers.size() > 2 * sleepingAgents.entities.size() + 64) {
+        // drop entries for stalkers that already woke some other way
+        stalkSleepers.erase(std::remove_if(stalkSleepers.begin(), stalkSleepers.end(),
+            [&](const AIWakeEntry& entry) { return !IsAsleep(entry); }), stalkSleepers.end());
     }
 
-    HandleEnemyAttacks(renderer);
+    // holding stalkers keep turning to face the player, the same way StalkPlayer's Hold band would
+    for (const AIWakeEntry& entry : stalkSleepers) {
+        if (!IsAsleep(entry)) continue;
+        int agent = agents.IndexOf(entry.entity);
+        if (agent < 0) continue;
+        vec2 toPlayer = vec2(playerPos.x - agents.px[agent], playerPos.y - agents.py[agent]);
+        agents.motion[agent]->velocity = aimath::NormalizeClamped(toPlayer) * 0.0001f;
+    }
 }
 
-void AISystem::InitializeStatus()
+// Agents that just ticked and are waiting in Patrol or holding the stalk band go to sleep until something could change that
+void AISystem::SleepIdleAgents()
 {
-    playerEntity = registry.players.entities[0];
-    status->playerEntity = &playerEntity;
+    AI_PROFILE_SCOPE("SleepIdleAgents");
+    vec2 playerPos = targets.position(targets.primary);
+    size_t sleptBefore = sleepingAgents.entities.size();
+
+    for (uint32_t agent : tickAgents) {
+        Entity entity = agents.entities[agent];
+        BehaviorTree* tree = GetBehaviorTree(agents.type[agent]);
+        if (!tree) continue;
+        // a leaf cursor means that leaf returned Running
+        NodeType type = tree->compiled.nodes[agents.behavior[agent].currentNode].type;
+        bool stalking = type == NodeType::StalkPlayer || type == NodeType::TimedStalkPlayer;
+        if (type != NodeType::Patrol && type != NodeType::TimedPatrol && !stalking) continue;
+
+        Motion& motion = *agents.motion[agent];
+        float detectionRadius = agents.detectionRadius[agent];
+        vec2 diff = motion.position - playerPos;
+        float dist = sqrtf(diff.x * diff.x + diff.y * diff.y);
+        AISleep sleep;
+        sleep.generation = ++sleepGeneration;
+        sleep.sleptAtMs = aiTimeMs;
+
+        if (type == NodeType::Patrol || type == NodeType::TimedPatrol) {
+            // closest the player and the agent can get before either could be within detection range
+            float gap = dist - detectionRadius - WAKE_DISTANCE_MARGIN;
+            if (gap <= 0) continue;
+            float closingSpeed = wakePlayerSpeed + sqrtf(motion.velocity.x * motion.velocity.x + motion.velocity.y * motion.velocity.y);
+            double wakeTime = closingSpeed > 0 ? aiTimeMs + gap / closingSpeed * 1000.0 : INFINITY;
+
+            if (type == NodeType::TimedPatrol) {
+#ifdef AI_COROUTINES
+                // the walk task says when it next does something, unless it isn't running (every slot taken)
+                AITask* task = taskPool.Get(agents.behavior[agent].task);
+                double resumeAtMs;
+                if (!task || !task->WaitingUntil(resumeAtMs)) continue;
+                sleep.reason = AISleep::Reason::Patrol;
+                wakeOnTime.push({ std::min(wakeTime, resumeAtMs), entity, sleep.generation });
+                sleepingAgents.insert(entity, sleep, false);
+#endif
+                continue;
+            }
+
+            // rolls are known ahead of time, so find the first frame where Patrol would act on one
+            uint32_t id = RandomKey(entity);
+            uint32_t wakeFrame = frameIndex + WAKE_MAX_SLEEP_FRAMES;
+            for (uint32_t frame = frameIndex + 1; frame < wakeFrame; frame++) {
+                if (Patrol::RollActs(random.Range(id, frame, 0, 1, 1000))) {
+                    wakeFrame = frame;
+                    break;
+                }
+            }
+
+            sleep.reason = AISleep::Reason::Patrol;
+            wakeOnFrame.push({ (double)wakeFrame, entity, sleep.generation });
+            wakeOnTime.push({ wakeTime, entity, sleep.generation });
+        } else {
+            // only the hold-position part of the band is stable - approaching or backing off keeps moving the agent
+            if (agents.type[agent] != AIType::Goblin) continue;
+            bool selfEngaging = dist <= GOBLIN_ALLY_RADIUS;
+            if (enemiesEngagingPlayer - (selfEngaging ? 1 : 0) > 0) continue;
+            float margin = std::min(dist - detectionRadius * 0.55f, detectionRadius * 0.6f - dist) - WAKE_BAND_MARGIN;
+            if (margin <= 0) continue;
+
+            sleep.reason = AISleep::Reason::Stalk;
+            wakeOnTravel.push({ playerTravel + margin, entity, sleep.generation });
+            stalkSleepers.push_back({ 0, entity, sleep.generation });
+        }
+        sleepingAgents.insert(entity, sleep, false);
+    }
+
+    if (sleepingAgents.entities.size() != sleptBefore) {
+        awakeEntities.erase(std::remove_if(awakeEntities.begin(), awakeEntities.end(),
+            [&](Entity entity) { return sleepingAgents.has(entity); }), awakeEntities.end());
+    }
 }
 
-void AISystem::ProcessAI(Entity entity)
+bool AISystem::IsAsleep(const AIWakeEntry& entry)
 {
-    HasAI& ai = registry.hasAIs.get(entity);
-    RemoveEnemyAttackIfPresent(entity);
+    return sleepingAgents.has(entry.entity) && sleepingAgents.get(entry.entity).generation == entry.generation;
+}
 
-    UpdateAIStatus(entity, ai);
+void AISystem::WakeEntity(Entity entity)
+{
+    // level of detail counts the time asleep as time since the last tick
+    int agent = agents.IndexOf(entity);
+    if (agent >= 0) {
+        agents.lod[agent].pendingMs += (float)(aiTimeMs - sleepingAgents.get(entity).sleptAtMs);
+    }
+    sleepingAgents.remove(entity);
+    awakeEntities.push_back(entity);
+}
 
-    if (ai.type == AIType::Skeleton || ai.type == AIType::MiniBoss) {
-        skeletonCurrentNode = skeletonCurrentNode->run();
-    } else if (ai.type == AIType::Goblin) {
-        UpdateGoblinBehavior(entity);
-        goblinCurrentNode = goblinCurrentNode->run();
-    } else if (ai.type == AIType::Mushroom) {
-        mushroomCurrentNode = mushroomCurrentNode->run();
+void AISystem::WakeAgent(Entity entity)
+{
+    if (sleepingAgents.has(entity)) WakeEntity(entity);
+}
+
+void AISystem::LoadLevel(int width, int height, float tileSize, vec2 origin, const std::vector<uint8_t>& walls)
+{
+    if (walls.size() != (size_t)width * height) {
+        printf("ERROR LoadLevel: %zu wall entries for a %dx%d level\n", walls.size(), width, height);
+        return;
     }
+    navGrid.Resize(width, height, tileSize, origin);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            if (walls[y * width + x]) navGrid.SetBlocked(x, y, true);
+        }
+    }
+    wallField.Build(navGrid);
+}
+
+void AISystem::SetWallTile(int x, int y, bool wall)
+{
+    if (!navGrid.InBounds(x, y) || navGrid.IsBlocked(x, y) == wall) return;
+    navGrid.SetBlocked(x, y, wall);
+    wallField.Build(navGrid);
 }
 
-void AISystem::RemoveEnemyAttackIfPresent(Entity entity)
+void AISystem::OnAIAdded(Entity entity)
 {
-    if (registry.enemyAttacks.has(entity)) {
-        registry.enemyAttacks.remove(entity);
+    if (!registry.hasAIs.has(entity)) {
+        printf("ERROR OnAIAdded: entity %u has no HasAI\n", (unsigned int)entity);
+        return;
     }
+    if (agents.IndexOf(entity) < 0) agents.Add(entity);
 }
 
-void AISystem::UpdateAIStatus(Entity entity, HasAI& ai)
+void AISystem::OnAIRemoved(Entity entity)
 {
-    status->aiMotion = &registry.motions.get(entity);
-    status->playerMotion = &registry.motions.get(playerEntity);
-    status->playerNearby = IsNearby(*status->aiMotion, *status->playerMotion, ai.detectionRadius);
-    status->playerAttackable = IsNearby(*status->aiMotion, *status->playerMotion, registry.enemies.get(entity).attackRadius);
-    status->aiEntity = &entity;
-    status->shouldAttack = true;
+#ifdef AI_COROUTINES
+    int agent = agents.IndexOf(entity);
+    if (agent >= 0) taskPool.Release(agents.behavior[agent].task);
+#endif
+    agents.Remove(entity);
+}
 
-    GenerateRandomNumbers();
+void AISystem::OnAIChanged(Entity entity)
+{
+    agents.Refresh(entity);
+    DropRetypedState();
 }
 
-void AISystem::UpdateGoblinBehavior(Entity entity)
+// A new type means a new tree - the old tree's task and sleep don't carry over (the working set resets the cursor)
+void AISystem::DropRetypedState()
 {
-    for (Entity otherEntity : registry.hasAIs.entities) {
-        status->shouldAttack = false;
-        if (otherEntity != entity) {
-            if (IsNearby(*status->playerMotion, registry.motions.get(otherEntity), 120)) {
-                status->shouldAttack = true;
-                break;
+#ifdef AI_COROUTINES
+    for (int32_t task : agents.droppedTasks) taskPool.Release(task);
+#endif
+    for (Entity entity : agents.retyped) WakeAgent(entity);
+    agents.droppedTasks.clear();
+    agents.retyped.clear();
+}
+
+// Turning eventWakeups off (or a second target turning up) puts everyone back on the tick list
+void AISystem::ClearWakeups()
+{
+    sleepingAgents.clear();
+    awakeEntities.clear();
+    wakeOnFrame = WakeQueue();
+    wakeOnTime = WakeQueue();
+    wakeOnTravel = WakeQueue();
+    stalkSleepers.clear();
+    trackedAICount = 0;
+    trackedAIIdSum = 0;
+    wakeupsStarted = false;
+}
+
+// One pass over the agents that use their perception this frame - the tick list, plus every bat when the fused boid
+// update moves them all - so each agent-to-target relation (the target, how far, which way, and whether the agent
+// detects it, can attack it or where it is in the stalk band) is worked out once. Sleeping and LOD-deferred agents are
+// left out, so like the tree phase this costs only as much as the agents that run.
+void AISystem::UpdatePerception()
+{
+    AI_PROFILE_SCOPE("UpdatePerception");
+    Perception& p = perception;
+    bool allBats = fusedBoidUpdate || flockBoids;
+    p.agents.clear();
+    for (uint32_t agent : tickAgents) {
+        if (!allBats || agents.type[agent] != AIType::Bat) p.agents.push_back(agent);
+    }
+    if (allBats) {
+        std::pair<uint32_t, uint32_t> bats = agents.TypeRange(AIType::Bat);
+        for (uint32_t agent = bats.first; agent < bats.second; agent++) {
+            p.agents.push_back(agent);
+        }
+    }
+
+    size_t size = agents.size();
+    p.target.resize(size);
+    p.tx.resize(size); p.ty.resize(size);
+    p.distSq.resize(size); p.invDist.resize(size);
+    p.dirX.resize(size); p.dirY.resize(size);
+    p.flags.resize(size);
+    p.band.resize(size);
+
+    size_t count = p.agents.size();
+    if (targets.size() == 1) {
+        // gathered so DistancesTo can run over contiguous arrays
+        vec2 target = targets.position(0);
+        p.px.resize(count); p.py.resize(count);
+        p.gatherDistSq.resize(count); p.gatherInvDist.resize(count);
+        for (size_t k = 0; k < count; k++) {
+            p.px[k] = agents.px[p.agents[k]];
+            p.py[k] = agents.py[p.agents[k]];
+        }
+        aimath::DistancesTo(p.px.data(), p.py.data(), count, target, p.gatherDistSq.data(), p.gatherInvDist.data());
+        for (size_t k = 0; k < count; k++) {
+            uint32_t i = p.agents[k];
+            p.target[i] = 0;
+            p.tx[i] = target.x;
+            p.ty[i] = target.y;
+            p.distSq[i] = p.gatherDistSq[k];
+            p.invDist[i] = p.gatherInvDist[k];
+        }
+    } else {
+        for (uint32_t i : p.agents) {
+            int target = targets.Select(vec2(agents.px[i], agents.py[i]), agents.detectionRadius[i]);
+            p.target[i] = target;
+            p.tx[i] = targets.px[target];
+            p.ty[i] = targets.py[target];
+            p.distSq[i] = aimath::LengthSq(p.tx[i] - agents.px[i], p.ty[i] - agents.py[i]);
+            p.invDist[i] = aimath::InvSqrt(p.distSq[i]);
+        }
+    }
+
+    bool checkSight = lineOfSight && !navGrid.empty();
+    if (checkSight) {
+        playerVisibility.Update(navGrid, targets.position(targets.primary));
+    }
+
+    for (uint32_t i : p.agents) {
+        float dx = p.tx[i] - agents.px[i];
+        float dy = p.ty[i] - agents.py[i];
+        // same as aimath::NormalizeClamped, so agents standing on their target don't get an infinite direction
+        float invLength = p.distSq[i] > 0.001f * 0.001f ? p.invDist[i] : 1.f / 0.001f;
+        p.dirX[i] = dx * invLength;
+        p.dirY[i] = dy * invLength;
+
+        bool visible = true;
+        if (checkSight) {
+            vec2 position = vec2(agents.px[i], agents.py[i]);
+            int x0, y0, x1, y1;
+            if (p.target[i] == targets.primary) {
+                visible = playerVisibility.Visible(position);
+            } else if (navGrid.TileAt(position, x0, y0) && navGrid.TileAt(vec2(p.tx[i], p.ty[i]), x1, y1)) {
+                visible = navGrid.LineOfSight(x0, y0, x1, y1);
             }
         }
+        float detectionRadius = agents.detectionRadius[i];
+        float attackRadius = agents.attackRadius[i];
+        uint8_t flags = visible ? Perception::Visible : 0;
+        if (visible && p.distSq[i] <= detectionRadius * detectionRadius) flags |= Perception::Detected;
+        if (visible && p.distSq[i] <= attackRadius * attackRadius) flags |= Perception::Attackable;
+        p.flags[i] = flags;
+
+        float dist = p.distSq[i] * p.invDist[i];
+        p.band[i] = dist > detectionRadius * 0.6 ? StalkBand::Approach : (dist > detectionRadius * 0.55 ? StalkBand::Hold : StalkBand::Retreat);
+    }
+}
+
+void AISystem::SetTickTarget(size_t tickIndex, AIStatus* status)
+{
+    uint32_t agent = tickAgents[tickIndex];
+    int target = perception.target[agent];
+    status->target = target;
+    status->targetPosition = vec2(perception.tx[agent], perception.ty[agent]);
+    status->playerDistSq = perception.distSq[agent];
+    status->targetDirection = vec2(perception.dirX[agent], perception.dirY[agent]);
+    status->stalkBand = perception.band[agent];
+    status->flowField = useFlowField && !navGrid.empty() && target == targets.primary ? &playerFlowField : nullptr;
+}
+
+void AISystem::InitializeStatus()
+{
+    targets.Build(decoys, TARGET_GRID_CELL_SIZE);
+}
+
+// Drop attack cycles of entities that lost their AI (died, level cleared) since the last step - tree and LOD state
+// go with the agent when it leaves the working set
+void AISystem::PruneAttackStates()
+{
+    for (int i = (int)attackStates.entities.size() - 1; i >= 0; i--) {
+        Entity entity = attackStates.entities[i];
+        if (!registry.hasAIs.has(entity)) {
+            attackStates.remove(entity);
+        }
+    }
+}
+
+// Fills tickAgents with the agents to update this frame, in candidate order
+void AISystem::ScheduleAI(float elapsedMs)
+{
+    AI_PROFILE_SCOPE("ScheduleAI");
+    tickAgents.clear();
+    if (wakeupsStarted) {
+        for (Entity entity : awakeEntities) {
+            int agent = agents.IndexOf(entity);
+            if (agent >= 0) tickAgents.push_back((uint32_t)agent);
+        }
+    } else {
+        for (uint32_t agent = 0; agent < agents.size(); agent++) {
+            tickAgents.push_back(agent);
+        }
+    }
+    if (!levelOfDetail) return;
+
+    size_t nearCount = 0;
+    deferredAgents.clear();
+    for (uint32_t agent : tickAgents) {
+        AILodState& lod = agents.lod[agent];
+        lod.pendingMs += elapsedMs;
+
+        float detectionRadius = agents.detectionRadius[agent];
+        vec2 position = vec2(agents.px[agent], agents.py[agent]);
+        float nearDist = detectionRadius * LOD_NEAR_RATIO;
+        float distSq = aimath::DistanceSq(position, targets.position(targets.Select(position, nearDist)));
+        if (distSq <= nearDist * nearDist) {
+            lod.scheduled = true;
+            nearCount++;
+            continue;
+        }
+
+        float midDist = detectionRadius * LOD_MID_RATIO;
+        uint32_t interval = distSq <= midDist * midDist ? LOD_MID_INTERVAL : LOD_FAR_INTERVAL;
+        // the id staggers agents across frames so each frame gets about 1/interval of the tier
+        if (lod.overdue || (frameIndex + RandomKey(agents.entities[agent])) % interval == 0) {
+            deferredAgents.push_back(agent);
+        }
+    }
+
+    // a timing based budget would make the schedule differ between recording and replay
+    size_t deferredTicks = deferredAgents.size();
+    if (lodBudgetMs > 0 && lodAgentNs > 0 && !recorder.IsOpen() && replayIds.empty()) {
+        double remainingNs = lodBudgetMs * 1e6 - nearCount * lodAgentNs;
+        size_t fit = remainingNs > 0 ? (size_t)(remainingNs / lodAgentNs) : 0;
+        deferredTicks = std::min(deferredTicks, std::max(fit, LOD_MIN_DEFERRED_TICKS));
+    }
+    if (deferredTicks < deferredAgents.size()) {
+        // whoever has waited longest goes first, the rest wait for the next frame
+        std::nth_element(deferredAgents.begin(), deferredAgents.begin() + deferredTicks, deferredAgents.end(),
+            [&](uint32_t a, uint32_t b) { return agents.lod[a].pendingMs > agents.lod[b].pendingMs; });
+        for (size_t i = deferredTicks; i < deferredAgents.size(); i++) {
+            agents.lod[deferredAgents[i]].overdue = true;
+        }
+    }
+    for (size_t i = 0; i < deferredTicks; i++) {
+        agents.lod[deferredAgents[i]].scheduled = true;
+    }
+
+    // keep the scheduled candidates, in order
+    size_t kept = 0;
+    for (uint32_t agent : tickAgents) {
+        AILodState& lod = agents.lod[agent];
+        if (!lod.scheduled) continue;
+        lod.tickMs = lod.pendingMs;
+        lod.pendingMs = 0;
+        lod.scheduled = false;
+        lod.overdue = false;
+        tickAgents[kept++] = agent;
+    }
+    tickAgents.resize(kept);
+}
+
+BehaviorTree* AISystem::GetBehaviorTree(AIType type)
+{
+    if (type == AIType::Skeleton || type == AIType::MiniBoss) return skeletonTree;
+    if (type == AIType::Goblin) return goblinTree;
+    if (type == AIType::Mushroom) return mushroomTree;
+    return nullptr;
+}
+
+void AISystem::ProcessAI(size_t tickIndex, AIStatus* status)
+{
+    AI_PROFILE_SCOPE("ProcessAI");
+    uint32_t agent = tickAgents[tickIndex];
+    Entity entity = agents.entities[agent];
+    status->aiEntity = &entity;
+    SetTickTarget(tickIndex, status);
+
+    UpdateAIStatus(agent, status);
+    GenerateRandomNumbers(status);
+
+    BehaviorTree* tree = GetBehaviorTree(agents.type[agent]);
+    if (!tree) return;
+
+    BehaviorState& behavior = agents.behavior[agent];
+    status->behavior = &behavior;
+    behavior.wantsAttack = false;
+    if (levelOfDetail) {
+        status->elapsedMs = agents.lod[agent].tickMs;
+    }
+
+    if (agents.type[agent] == AIType::Goblin) {
+        UpdateGoblinBehavior(status);
+    }
+
+    // resume from wherever this entity left off last tick
+    if (useStaticTrees && tree->staticTick) {
+        behavior.currentNode = tree->staticTick(behavior.currentNode, status);
+    } else if (useCompiledTrees) {
+        behavior.currentNode = tree->compiled.tick(behavior.currentNode, status);
+    } else {
+        Node* current = tree->nodes[behavior.currentNode];
+        behavior.currentNode = current->run(status)->index;
+    }
+}
+
+void AISystem::ProcessAIParallel()
+{
+    AI_PROFILE_SCOPE("ProcessAIParallel");
+    if (!jobPool) {
+        int threads = (int)std::thread::hardware_concurrency();
+        jobPool = std::make_unique<AIJobPool>(std::max(1, threads - 1));
+    }
+
+    size_t count = tickAgents.size();
+    size_t chunkCount = (count + AI_PARALLEL_CHUNK_SIZE - 1) / AI_PARALLEL_CHUNK_SIZE;
+    workerStatuses.assign(jobPool->getWorkerCount(), *status);
+
+    jobPool->Run(chunkCount, [&](size_t chunk, int worker) {
+        AIStatus* workerStatus = &workerStatuses[worker];
+
+        size_t end = std::min(count, (chunk + 1) * AI_PARALLEL_CHUNK_SIZE);
+        for (size_t i = chunk * AI_PARALLEL_CHUNK_SIZE; i < end; i++) {
+            ProcessAI(i, workerStatus);
+        }
+    });
+}
+
+void AISystem::LeafBatch::clear()
+{
+    behavior.clear(); motion.clear(); id.clear();
+    node.clear(); parent.clear();
+    vx.clear(); vy.clear();
+    speed.clear();
+    dirX.clear(); dirY.clear();
+    flowX.clear(); flowY.clear();
+    nearby.clear(); attackable.clear(); shouldAttack.clear();
+    band.clear();
+    rand.clear(); rand2.clear();
+    result.clear();
+}
+
+void AISystem::LeafBatch::push(AIStatus& status, BehaviorState& state, uint32_t randomKey, int nodeIndex, const CompiledNode& compiledNode)
+{
+    behavior.push_back(&state);
+    motion.push_back(status.aiMotion);
+    id.push_back(randomKey);
+    node.push_back((uint16_t)nodeIndex);
+    parent.push_back(compiledNode.parent);
+    vx.push_back(status.aiMotion->velocity.x);
+    vy.push_back(status.aiMotion->velocity.y);
+    speed.push_back(status.aiMotion->speed);
+    dirX.push_back(status.targetDirection.x);
+    dirY.push_back(status.targetDirection.y);
+    vec2 flow = status.flowField ? status.flowField->DirectionAt(status.aiMotion->position) : vec2(0, 0);
+    flowX.push_back(flow.x);
+    flowY.push_back(flow.y);
+    nearby.push_back(status.playerNearby);
+    attackable.push_back(status.playerAttackable);
+    shouldAttack.push_back(status.shouldAttack);
+    band.push_back(status.stalkBand);
+    rand.push_back(status.rand);
+    rand2.push_back(status.rand2);
+    result.push_back(NodeState::False);
+}
+
+AISystem::LeafBatch* AISystem::GetLeafBatch(NodeType type)
+{
+    if (type == NodeType::Patrol) return &patrolBatch;
+    if (type == NodeType::ChasePlayer) return &chaseBatch;
+    if (type == NodeType::StalkPlayer) return &stalkBatch;
+    return nullptr;
+}
+
+// Batched versions of Patrol::tick, ChasePlayer::tick and StalkPlayer::tick
+void AISystem::TickPatrolBatch(LeafBatch& b)
+{
+    for (size_t i = 0; i < b.result.size(); i++) {
+        if (b.nearby[i]) {
+            b.result[i] = NodeState::False;
+            continue;
+        }
+        int roll = b.rand[i];
+        if (roll >= 97 && roll <= 98) {
+            b.vx[i] = 0;
+            b.vy[i] = 0;
+        } else if (roll >= 99 && roll <= 100) {
+            b.vx[i] = ((roll % 10) - 4.5f) * b.speed[i] / 9;
+            b.vy[i] = ((b.rand2[i] % 10) - 4.5f) * b.speed[i] / 9;
+        }
+        b.result[i] = NodeState::Running;
     }
 }
 
-void AISystem::GenerateRandomNumbers()
+void AISystem::TickChaseBatch(LeafBatch& b)
 {
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> distRand(1, 1000);
-    std::uniform_int_distribution<> distRand2(1, 1000);
-    status->rand = distRand(gen);
-    status->rand2 = distRand2(gen);
+    for (size_t i = 0; i < b.result.size(); i++) {
+        bool attack = b.attackable[i] && b.shouldAttack[i];
+        bool chase = !attack && b.nearby[i] && b.shouldAttack[i];
+        bool stop = !attack && !chase;
+
+        // same as SteerTowardsPlayer - the flow direction when there is one
+        bool flow = b.flowX[i] != 0 || b.flowY[i] != 0;
+        float chaseX = (flow ? b.flowX[i] : b.dirX[i]) * b.speed[i];
+        float chaseY = (flow ? b.flowY[i] : b.dirY[i]) * b.speed[i];
+        b.vx[i] = chase ? chaseX : (stop ? b.vx[i] / 2 : b.vx[i]);
+        b.vy[i] = chase ? chaseY : (stop ? b.vy[i] / 2 : b.vy[i]);
+        b.result[i] = attack ? NodeState::True : (chase ? NodeState::Running : NodeState::False);
+    }
+}
+
+void AISystem::TickStalkBatch(LeafBatch& b)
+{
+    for (size_t i = 0; i < b.result.size(); i++) {
+        if (b.shouldAttack[i]) {
+            b.result[i] = NodeState::True;
+            continue;
+        }
+        if (!b.nearby[i]) {
+            b.result[i] = NodeState::False;
+            continue;
+        }
+        // approach, hold and face the player, or back off
+        bool approach = b.band[i] == StalkBand::Approach;
+        float bandSpeed = approach ? b.speed[i] : (b.band[i] == StalkBand::Hold ? 0.0001f : -b.speed[i]);
+        bool flow = approach && (b.flowX[i] != 0 || b.flowY[i] != 0);
+        b.vx[i] = flow ? b.flowX[i] * b.speed[i] : b.dirX[i] * bandSpeed;
+        b.vy[i] = flow ? b.flowY[i] * b.speed[i] : b.dirY[i] * bandSpeed;
+        b.result[i] = NodeState::Running;
+    }
+}
+
+void AISystem::ApplyLeafBatch(LeafBatch& batch)
+{
+    AI_PROFILE_COUNT(nodesVisited, batch.result.size());
+    for (size_t i = 0; i < batch.result.size(); i++) {
+        batch.motion[i]->velocity = vec2(batch.vx[i], batch.vy[i]);
+        BehaviorState* behavior = batch.behavior[i];
+        behavior->nodeStates[batch.node[i]] = batch.result[i];
+        behavior->currentNode = batch.result[i] == NodeState::Running ? batch.node[i] : batch.parent[i];
+    }
 }
 
-void AISystem::UpdateEntityMovement(Entity entity)
+// Data-oriented tick: agents resuming at a Patrol, ChasePlayer or StalkPlayer leaf are gathered per leaf type,
+// each leaf runs once over its whole batch, then velocities and cursors are written back.
+// Leaves in the batches never touch the registry, so registry writes still happen in entity order.
+void AISystem::ProcessAIBatched()
+{
+    AI_PROFILE_SCOPE("ProcessAIBatched");
+    patrolBatch.clear();
+    chaseBatch.clear();
+    stalkBatch.clear();
+
+    for (size_t i = 0; i < tickAgents.size(); i++) {
+        uint32_t agent = tickAgents[i];
+        Entity entity = agents.entities[agent];
+        AIType type = agents.type[agent];
+        BehaviorTree* tree = GetBehaviorTree(type);
+        LeafBatch* batch = nullptr;
+        int cursor = 0;
+        if (tree) {
+            cursor = agents.behavior[agent].currentNode;
+            batch = GetLeafBatch(tree->compiled.nodes[cursor].type);
+        }
+        if (!batch) {
+            ProcessAI(i, status);
+            continue;
+        }
+
+        status->aiEntity = &entity;
+        SetTickTarget(i, status);
+        agents.behavior[agent].wantsAttack = false;
+        UpdateAIStatus(agent, status);
+        if (type == AIType::Goblin) {
+            UpdateGoblinBehavior(status);
+        }
+        batch->push(*status, agents.behavior[agent], RandomKey(entity), cursor, tree->compiled.nodes[cursor]);
+    }
+
+    // only Patrol uses the rolls, so they're generated for that batch in one go
+    random.FillRolls(patrolBatch.id.data(), patrolBatch.id.size(), frameIndex, patrolBatch.rand.data(), patrolBatch.rand2.data());
+
+    TickPatrolBatch(patrolBatch);
+    TickChaseBatch(chaseBatch);
+    TickStalkBatch(stalkBatch);
+
+    ApplyLeafBatch(patrolBatch);
+    ApplyLeafBatch(chaseBatch);
+    ApplyLeafBatch(stalkBatch);
+}
+
+void AISystem::UpdateAIStatus(uint32_t agent, AIStatus* status)
+{
+    status->aiMotion = agents.motion[agent];
+    status->attackCooldownMs = agents.attackCooldown[agent];
+    // the target and playerDistSq were filled in by the caller from perception
+    status->playerNearby = (perception.flags[agent] & Perception::Detected) != 0;
+    status->playerAttackable = (perception.flags[agent] & Perception::Attackable) != 0;
+    status->shouldAttack = true;
+}
+
+// applies a permutation, values[i] = old values[order[i]]
+template <typename T>
+static void ApplyOrder(std::vector<T>& values, const std::vector<uint32_t>& order)
+{
+    std::vector<T> old(values.begin(), values.end());
+    for (size_t i = 0; i < order.size(); i++) {
+        values[i] = old[order[i]];
+    }
+}
+
+void AIWorkingSet::Add(Entity entity)
 {
     HasAI& ai = registry.hasAIs.get(entity);
-    if (ai.type == AIType::Bat) {
-        MoveBoid(entity);
+    // spawning in type order keeps the set sorted
+    sorted = sorted && (type.empty() || type.back() <= ai.type);
+    indices[(unsigned int)entity] = (uint32_t)entities.size();
+    idSum += (unsigned int)entity;
+    entities.push_back(entity);
+    type.push_back(ai.type);
+    detectionRadius.push_back(ai.detectionRadius);
+    attackRadius.push_back(registry.enemies.has(entity) ? registry.enemies.get(entity).attackRadius : 0);
+    attackCooldown.push_back(registry.enemies.has(entity) ? registry.enemies.get(entity).attackCoolDown : 0);
+    behavior.emplace_back();
+    lod.emplace_back();
+    motion.push_back(nullptr);
+    px.push_back(0); py.push_back(0);
+    vx.push_back(0); vy.push_back(0);
+    speed.push_back(0);
+}
+
+void AIWorkingSet::Remove(Entity entity)
+{
+    int index = IndexOf(entity);
+    if (index < 0) return;
+    uint32_t last = (uint32_t)entities.size() - 1;
+    if ((uint32_t)index != last) {
+        entities[index] = entities[last];
+        type[index] = type[last];
+        detectionRadius[index] = detectionRadius[last];
+        attackRadius[index] = attackRadius[last];
+        attackCooldown[index] = attackCooldown[last];
+        behavior[index] = behavior[last];
+        lod[index] = lod[last];
+        motion[index] = motion[last];
+        px[index] = px[last]; py[index] = py[last];
+        vx[index] = vx[last]; vy[index] = vy[last];
+        speed[index] = speed[last];
+        indices[(unsigned int)entities[index]] = index;
+        sorted = false;
+    }
+    entities.pop_back();
+    type.pop_back();
+    detectionRadius.pop_back();
+    attackRadius.pop_back();
+    attackCooldown.pop_back();
+    behavior.pop_back();
+    lod.pop_back();
+    motion.pop_back();
+    px.pop_back(); py.pop_back();
+    vx.pop_back(); vy.pop_back();
+    speed.pop_back();
+    indices.erase((unsigned int)entity);
+    idSum -= (unsigned int)entity;
+}
+
+void AIWorkingSet::Refresh(Entity entity)
+{
+    int index = IndexOf(entity);
+    if (index >= 0) ReadCachedFields((uint32_t)index);
+}
+
+void AIWorkingSet::ReadCachedFields(uint32_t index)
+{
+    Entity entity = entities[index];
+    HasAI& ai = registry.hasAIs.get(entity);
+    if (type[index] != ai.type) {
+        // the cursor and node states index the old type's tree, which can be smaller than the new one
+        if (behavior[index].task >= 0) droppedTasks.push_back(behavior[index].task);
+        retyped.push_back(entity);
+        behavior[index] = BehaviorState();
+        lod[index] = AILodState();
+        sorted = false;
+    }
+    type[index] = ai.type;
+    detectionRadius[index] = ai.detectionRadius;
+    attackRadius[index] = registry.enemies.has(entity) ? registry.enemies.get(entity).attackRadius : 0;
+    attackCooldown[index] = registry.enemies.has(entity) ? registry.enemies.get(entity).attackCoolDown : 0;
+}
+
+bool AIWorkingSet::Sync()
+{
+    // catches anything added or removed without a notification - one pass summing ids, like the wakeup bookkeeping
+    uint64_t registryIdSum = 0;
+    for (Entity entity : registry.hasAIs.entities) {
+        registryIdSum += (unsigned int)entity;
+    }
+    bool rebuilt = registryIdSum != idSum || registry.hasAIs.entities.size() != entities.size();
+    if (rebuilt) {
+        Rebuild();
+    }
+
+    for (uint32_t i = 0; i < entities.size(); i++) {
+        // edits to HasAI and Enemy aren't always reported, so the cached fields are read again as well
+        ReadCachedFields(i);
+        Motion& entityMotion = registry.motions.get(entities[i]);
+        motion[i] = &entityMotion;
+        px[i] = entityMotion.position.x;
+        py[i] = entityMotion.position.y;
+        vx[i] = entityMotion.velocity.x;
+        vy[i] = entityMotion.velocity.y;
+        speed[i] = entityMotion.speed;
+    }
+    // after the fields are read, so a type change found above is sorted into place this frame
+    if (!sorted) {
+        SortByType();
+    }
+    return rebuilt;
+}
+
+void AIWorkingSet::Clear()
+{
+    entities.clear();
+    type.clear();
+    detectionRadius.clear();
+    attackRadius.clear();
+    attackCooldown.clear();
+    behavior.clear();
+    lod.clear();
+    motion.clear();
+    px.clear(); py.clear();
+    vx.clear(); vy.clear();
+    speed.clear();
+    retyped.clear();
+    droppedTasks.clear();
+    indices.clear();
+    idSum = 0;
+    sorted = true;
+}
+
+int AIWorkingSet::IndexOf(Entity entity) const
+{
+    auto it = indices.find((unsigned int)entity);
+    return it == indices.end() ? -1 : (int)it->second;
+}
+
+std::pair<uint32_t, uint32_t> AIWorkingSet::TypeRange(AIType agentType) const
+{
+    auto range = std::equal_range(type.begin(), type.end(), agentType);
+    return { (uint32_t)(range.first - type.begin()), (uint32_t)(range.second - type.begin()) };
+}
+
+// stable, so agents of one type keep the order they were added in
+void AIWorkingSet::SortByType()
+{
+    order.resize(entities.size());
+    for (uint32_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {return type[a] < type[b];});
+
+    ApplyOrder(entities, order);
+    ApplyOrder(type, order);
+    ApplyOrder(detectionRadius, order);
+    ApplyOrder(attackRadius, order);
+    ApplyOrder(attackCooldown, order);
+    ApplyOrder(behavior, order);
+    ApplyOrder(lod, order);
+    ApplyOrder(motion, order);
+    ApplyOrder(px, order);
+    ApplyOrder(py, order);
+    ApplyOrder(vx, order);
+    ApplyOrder(vy, order);
+    ApplyOrder(speed, order);
+    for (uint32_t i = 0; i < entities.size(); i++) {
+        indices[(unsigned int)entities[i]] = i;
+    }
+    sorted = true;
+}
+
+// Back to registry order, keeping the tree and LOD state of the agents that were already in the set with the same type
+void AIWorkingSet::Rebuild()
+{
+    std::vector<BehaviorState> keptBehavior;
+    std::vector<AILodState> keptLod;
+    std::vector<Entity> keptRetyped;
+    keptBehavior.reserve(registry.hasAIs.entities.size());
+    keptLod.reserve(registry.hasAIs.entities.size());
+    for (Entity entity : registry.hasAIs.entities) {
+        int index = IndexOf(entity);
+        if (index >= 0 && type[index] != registry.hasAIs.get(entity).type) {
+            // the old task is released with the other unowned ones
+            keptRetyped.push_back(entity);
+            index = -1;
+        }
+        keptBehavior.push_back(index >= 0 ? behavior[index] : BehaviorState());
+        keptLod.push_back(index >= 0 ? lod[index] : AILodState());
+    }
+    keptRetyped.insert(keptRetyped.end(), retyped.begin(), retyped.end());
+
+    Clear();
+    for (Entity entity : registry.hasAIs.entities) {
+        Add(entity);
+    }
+    behavior.swap(keptBehavior);
+    lod.swap(keptLod);
+    retyped.swap(keptRetyped);
+}
+
+void PlayerProximity::Build(const AIWorkingSet& agents, vec2 playerPos, float maxRadius)
+{
+    float maxRadiusSq = maxRadius * maxRadius;
+    scratch.clear();
+    for (uint32_t i = 0; i < agents.size(); i++) {
+        float distSq = aimath::LengthSq(agents.px[i] - playerPos.x, agents.py[i] - playerPos.y);
+        if (distSq <= maxRadiusSq) scratch.push_back({ distSq, i });
+    }
+    // only the entities close to the player get sorted
+    std::sort(scratch.begin(), scratch.end());
+
+    distancesSq.clear();
+    entities.clear();
+    for (auto& entry : scratch) {
+        distancesSq.push_back(entry.first);
+        entities.push_back(agents.entities[entry.second]);
+    }
+}
+
+int PlayerProximity::CountWithin(float radius) const
+{
+    return (int)(std::upper_bound(distancesSq.begin(), distancesSq.end(), radius * radius) - distancesSq.begin());
+}
+
+void AITargetTable::Build(const std::vector<Entity>& decoys, float cellSize)
+{
+    entities.clear();
+    px.clear(); py.clear(); vx.clear(); vy.clear(); speed.clear();
+    vulnerable.clear();
+    grid.Clear(cellSize);
+    primary = -1;
+    int firstVulnerableDecoy = -1;
+
+    auto add = [&](Entity entity, bool player) {
+        if (!registry.motions.has(entity)) return;
+        Motion& motion = registry.motions.get(entity);
+        int target = (int)entities.size();
+        bool canBeHurt = !registry.deathTimers.has(entity);
+        entities.push_back(entity);
+        px.push_back(motion.position.x);
+        py.push_back(motion.position.y);
+        vx.push_back(motion.velocity.x);
+        vy.push_back(motion.velocity.y);
+        speed.push_back(motion.speed);
+        vulnerable.push_back(canBeHurt);
+        grid.Insert((uint32_t)target, motion.position);
+        if (canBeHurt && player && primary < 0) primary = target;
+        if (canBeHurt && !player && firstVulnerableDecoy < 0) firstVulnerableDecoy = target;
+    };
+    for (Entity player : registry.players.entities) add(player, true);
+    for (Entity decoy : decoys) add(decoy, false);
+    grid.Build();
+
+    if (primary < 0) primary = firstVulnerableDecoy;
+    if (primary < 0 && !entities.empty()) primary = 0;
+}
+
+int AITargetTable::Select(vec2 position, float radius) const
+{
+    if (entities.size() <= 1) return primary;
+    int best = -1;
+    float bestDistSq = radius * radius;
+    grid.Query(position, radius, [&](uint32_t target) {
+        if (!vulnerable[target]) return;
+        float distSq = aimath::LengthSq(px[target] - position.x, py[target] - position.y);
+        // ties go to the lower index so the choice doesn't depend on the grid's order
+        if (distSq < bestDistSq || (distSq == bestDistSq && (best < 0 || (int)target < best))) {
+            best = (int)target;
+            bestDistSq = distSq;
+        }
+    });
+    return best >= 0 ? best : primary;
+}
+
+void AITargetTable::CountEngaging(const AIWorkingSet& agents, float radius)
+{
+    engaging.assign(entities.size(), 0);
+    for (uint32_t i = 0; i < agents.size(); i++) {
+        vec2 position = vec2(agents.px[i], agents.py[i]);
+        grid.Query(position, radius, [&](uint32_t target) {
+            if (aimath::LengthSq(px[target] - position.x, py[target] - position.y) <= radius * radius) engaging[target]++;
+        });
+    }
+}
+
+void AISystem::UpdatePlayerProximity()
+{
+    playerProximity.Build(agents, targets.position(targets.primary), std::max(PLAYER_PROXIMITY_RADIUS, GOBLIN_ALLY_RADIUS));
+    if (targets.size() == 1) {
+        targets.engaging.assign(1, playerProximity.CountWithin(GOBLIN_ALLY_RADIUS));
+    } else {
+        targets.CountEngaging(agents, GOBLIN_ALLY_RADIUS);
+    }
+    enemiesEngagingPlayer = targets.engaging[targets.primary];
+}
+
+// Goblins only attack once some other enemy is already close to their target
+void AISystem::UpdateGoblinBehavior(AIStatus* status)
+{
+    bool selfEngaging = status->playerDistSq <= GOBLIN_ALLY_RADIUS * GOBLIN_ALLY_RADIUS;
+    status->shouldAttack = targets.engaging[status->target] - (selfEngaging ? 1 : 0) > 0;
+}
+
+// Rolls are keyed on the entity id, or on the id it had when recorded during a replay
+uint32_t AISystem::RandomKey(Entity entity)
+{
+    if (!replayIds.empty()) {
+        auto it = replayIds.find(entity);
+        if (it != replayIds.end()) return it->second;
+    }
+    return (uint32_t)entity;
+}
+
+void AISystem::GenerateRandomNumbers(AIStatus* status)
+{
+    uint32_t id = RandomKey(*status->aiEntity);
+    status->rand = random.Range(id, frameIndex, 0, 1, 1000);
+    status->rand2 = random.Range(id, frameIndex, 1, 1, 1000);
+    status->randomKey = id;
+}
+
+void AISystem::UpdateEntityMovement(uint32_t agent)
+{
+    AI_PROFILE_SCOPE("UpdateEntityMovement");
+    if (agents.type[agent] == AIType::Bat) {
+        MoveBoid(agent);
     }
 }
 
 bool AISystem::IsNearby(Motion& motion1, Motion& motion2, float nearbyRadius) {
-	float dist = sqrtf(pow((motion2.position.x-motion1.position.x), 2)  + pow((motion2.position.y - motion1.position.y), 2));
-	return (dist <= nearbyRadius);
+	AI_PROFILE_COUNT(isNearbyCalls, 1);
+	return aimath::WithinRadius(motion1.position, motion2.position, nearbyRadius);
 }
 
 
-void AISystem::attack_player(Entity damagingEnemy, float damage, RenderSystem* renderer) {
-	Player& curr_player = registry.players.get(player_entity);
-	Motion& player_motion = registry.motions.get(player_entity);
+void AISystem::LaunchEnemyAttack(Entity damagingEnemy, Entity target, float damage, RenderSystem* renderer) {
 	Motion& enemy_motion = registry.motions.get(damagingEnemy);
 	Enemy& enemy_component = registry.enemies.get(damagingEnemy);
+	vec2 target_position = registry.motions.get(target).position;
 
 	float ex = enemy_motion.position.x;
 	float ey = enemy_motion.position.y;
 
-	const float ENEMY_AS_MS = 231 * enemy_component.attackCoolDown;
-
-	float xDiff = player_motion.position.x - ex;
-	float yDiff = player_motion.position.y - ey;
+	float xDiff = target_position.x - ex;
 
 	if (xDiff > 0) {
 		enemy_motion.attackDirection = enemy_motion.RIGHT;
@@ -133,6 +1189,8 @@ void AISystem::attack_player(Entity damagingEnemy, float damage, RenderSystem* r
 			enemy_motion.direction = enemy_motion.LEFT;
 		}
 	}
+	// headless, nothing to draw the attack with
+	if (!renderer) return;
 	float enemy_attack_offset = 40;
 	if (enemy_motion.scale.x > 0) {
 		createEnemyAttack(renderer, vec2(ex + enemy_attack_offset, ey), enemy_component.damagePerAttack, 900, damagingEnemy);
@@ -142,50 +1200,369 @@ void AISystem::attack_player(Entity damagingEnemy, float damage, RenderSystem* r
 	}
 }
 
+// Sprite swaps edit the existing render request instead of removing and re-adding it
+static void SetEnemyTexture(Entity entity, TEXTURE_ASSET_ID texture)
+{
+    if (registry.renderRequests.has(entity)) {
+        RenderRequest& request = registry.renderRequests.get(entity);
+        request.used_texture = texture;
+        request.used_effect = EFFECT_ASSET_ID::DEFAULT_ANIMATION;
+        request.used_geometry = GEOMETRY_BUFFER_ID::SPRITE;
+    } else {
+        registry.renderRequests.insert(entity, { texture, EFFECT_ASSET_ID::DEFAULT_ANIMATION, GEOMETRY_BUFFER_ID::SPRITE });
+        AI_PROFILE_COUNT(registryInserts, 1);
+    }
+}
+
+void AISystem::SetAttackPhase(EnemyAttackState& state, EnemyAttackState::Phase phase)
+{
+    state.previous = state.phase;
+    state.phase = phase;
+    state.transitionFrame = frameIndex;
+    state.transitions++;
+}
+
+// The target an agent's AttackPlayer went after. An agent the LOD scheduler skipped this frame still wants the attack
+// from its last tick, when the target table may have been different - it goes after the primary target instead.
+Entity AISystem::AttackTargetOf(uint32_t agent) const
+{
+    int target = agents.behavior[agent].attackTarget;
+    if (target < 0 || target >= (int)targets.size()) target = targets.primary;
+    return targets.entities[target];
+}
+
+// Moves one enemy through its attack cycle, returns false once nothing more can happen this frame
+bool AISystem::AdvanceAttackState(Entity entity, EnemyAttackState& state, bool wantsAttack, RenderSystem* renderer)
+{
+    using Phase = EnemyAttackState::Phase;
+    switch (state.phase) {
+    case Phase::Idle: {
+        if (!wantsAttack) return false;
+        int agent = agents.IndexOf(entity);
+        if (agent < 0) return false;
+        state.target = AttackTargetOf(agent);
+        state.cooldownInTree = agents.behavior[agent].cooldownInTree;
+        if (!registry.enemyAttacks.has(entity)) {
+            registry.enemyAttacks.emplace(entity);
+            AI_PROFILE_COUNT(registryInserts, 1);
+        }
+        SetAttackPhase(state, Phase::Windup);
+        return true;
+    }
+
+    case Phase::Windup:
+        // the target went away during the windup
+        if (!wantsAttack || !registry.motions.has(state.target)) {
+            if (registry.enemyAttacks.has(entity)) {
+                registry.enemyAttacks.remove(entity);
+                AI_PROFILE_COUNT(registryRemoves, 1);
+            }
+            SetAttackPhase(state, Phase::Idle);
+            return true;
+        }
+        if ((state.cooldownInTree || !registry.attackCoolDown.has(entity)) && !registry.deathTimers.has(entity)) {
+            Enemy& enemy = registry.enemies.get(entity);
+            Motion& enemyMotion = registry.motions.get(entity);
+            // attack animation
+            enemyMotion.attacking = true;
+            enemyMotion.attackDirection = enemyMotion.RIGHT;
+            LaunchEnemyAttack(entity, state.target, enemy.damagePerAttack, renderer);
+            if (!state.cooldownInTree) {
+                AttackTimer timer = { enemy.attackCoolDown };
+                registry.attackCoolDown.insert(entity, timer, false);
+                AI_PROFILE_COUNT(registryInserts, 1);
+            }
+
+            enemyMotion.fc = 0;
+            SetEnemyTexture(entity, enemy.attackTexture);
+            SetAttackPhase(state, Phase::Attack);
+            return true;
+        }
+        return false;
+
+    case Phase::Attack: {
+        Motion& enemyMotion = registry.motions.get(entity);
+        if (enemyMotion.attacking) return false;
+        // animation is over - face where the enemy is going again
+        if (enemyMotion.velocity.x > 0) {
+            enemyMotion.scale = { abs(enemyMotion.scale.x) , enemyMotion.scale.y };
+            enemyMotion.direction = enemyMotion.RIGHT;
+        } else {
+            enemyMotion.scale = { -abs(enemyMotion.scale.x) , enemyMotion.scale.y };
+            enemyMotion.direction = enemyMotion.LEFT;
+        }
+        SetEnemyTexture(entity, registry.enemies.get(entity).movementTexture);
+        if (registry.enemyAttacks.has(entity)) {
+            registry.enemyAttacks.remove(entity);
+            AI_PROFILE_COUNT(registryRemoves, 1);
+        }
+        SetAttackPhase(state, Phase::Cooldown);
+        return true;
+    }
+
+    case Phase::Cooldown:
+        if (!state.cooldownInTree && registry.attackCoolDown.has(entity)) return false;
+        SetAttackPhase(state, Phase::Idle);
+        return true;
+    }
+    return false;
+}
+
+// Runs after the trees: starts attacks for enemies that want one and advances every attack in progress.
+// Enemies that are idle and not attacking cost one flag check in the dense tree state.
 void AISystem::HandleEnemyAttacks(RenderSystem* renderer) {
-	if (!registry.deathTimers.has(player_entity)) {
-		for (uint i = 0; i < registry.enemyAttacks.components.size(); i++) {
-			Entity entity_enemy = registry.enemyAttacks.entities[i];
-			Enemy& enemy = registry.enemies.get(entity_enemy);
-			Motion& enemyMotion = registry.motions.get(entity_enemy);
-			// attack animation
-			if (!registry.attackCoolDown.has(entity_enemy) && !registry.deathTimers.has(entity_enemy)) {
-				enemyMotion.attacking = true;
-				enemyMotion.attackDirection = enemyMotion.RIGHT;
-				attack_player(entity_enemy, enemy.damagePerAttack, renderer);
-				AttackTimer timer = { enemy.attackCoolDown };
-				registry.attackCoolDown.insert(entity_enemy, timer, false);
-
-				enemyMotion.fc = 0;
-				registry.renderRequests.remove(entity_enemy);
-				registry.renderRequests.insert(entity_enemy, { enemy.attackTexture,
-					EFFECT_ASSET_ID::DEFAULT_ANIMATION,
-					GEOMETRY_BUFFER_ID::SPRITE });
-			}
-			else if (enemyMotion.attacking == false) {
-				if (enemyMotion.velocity.x > 0) {
-					enemyMotion.scale = { abs(enemyMotion.scale.x) , enemyMotion.scale.y };
-					enemyMotion.direction = enemyMotion.RIGHT;
-				}
-				else {
-					enemyMotion.scale = { -abs(enemyMotion.scale.x) , enemyMotion.scale.y };
-					enemyMotion.direction = enemyMotion.LEFT;
-				}
-				registry.renderRequests.remove(entity_enemy);
-				registry.renderRequests.insert(entity_enemy, { enemy.movementTexture,
-					EFFECT_ASSET_ID::DEFAULT_ANIMATION,
-					GEOMETRY_BUFFER_ID::SPRITE });
-				registry.enemyAttacks.remove(entity_enemy);
-			}
-		}
-	}
+    AI_PROFILE_SCOPE("HandleEnemyAttacks");
+    if (!targets.AnyVulnerable()) return;
+
+    for (uint32_t agent = 0; agent < agents.size(); agent++) {
+        Entity entity = agents.entities[agent];
+        if (agents.behavior[agent].wantsAttack && !attackStates.has(entity)) {
+            attackStates.insert(entity, EnemyAttackState(AttackTargetOf(agent)), false);
+        }
+    }
+
+    // backwards, so finished cycles can be removed without skipping the entity swapped into their slot
+    for (int i = (int)attackStates.entities.size() - 1; i >= 0; i--) {
+        Entity entity = attackStates.entities[i];
+        EnemyAttackState& state = attackStates.components[i];
+        int agent = agents.IndexOf(entity);
+        bool wantsAttack = agent >= 0 && agents.behavior[agent].wantsAttack;
+        // a cycle can go all the way round in one frame (cooldown over and the player still in reach)
+        for (int step = 0; step < 4 && AdvanceAttackState(entity, state, wantsAttack, renderer); step++) {}
+        if (state.phase == EnemyAttackState::Phase::Idle && !wantsAttack) {
+            attackStates.remove(entity);
+        }
+    }
+}
+
+void AISystem::BuildBoidGrid() {
+    // cell size matches the grouping radius so a grouping query never touches more than a 3x3 block of cells
+    boidGrid.Clear(BOID_GROUPING_RADIUS);
+    boidEntities.clear();
+    boidMotions.clear();
+    boidAgents.clear();
+
+    // the bats sit together in the working set
+    std::pair<uint32_t, uint32_t> bats = agents.TypeRange(AIType::Bat);
+    for (uint32_t agent = bats.first; agent < bats.second; agent++) {
+        Motion* motion = agents.motion[agent];
+        boidGrid.Insert((uint32_t)boidEntities.size(), motion->position);
+        boidEntities.push_back(agents.entities[agent]);
+        boidMotions.push_back(motion);
+        boidAgents.push_back(agent);
+    }
+    boidGrid.Build();
+}
+
+void AISystem::BoidSoA::resize(size_t n) {
+    px.resize(n); py.resize(n);
+    vx.resize(n); vy.resize(n);
+    speed.resize(n);
+    chaseX.resize(n); chaseY.resize(n);
+    newVelocity.resize(n);
+    boid.resize(n);
+}
+
+// Same rules as MoveBoid (group, separate, match velocity, chase), but all neighbour sums come from one pass
+// over the packed arrays and velocities are written back in a single scatter at the end.
+void AISystem::MoveBoidsFused() {
+    AI_PROFILE_SCOPE("MoveBoidsFused");
+    size_t n = boidGrid.size();
+    boidSoA.resize(n);
+
+    // gather in grid slot order, with each bat's way to its target if it has detected it
+    for (size_t slot = 0; slot < n; slot++) {
+        uint32_t b = boidGrid.IndexAt(slot);
+        Motion& motion = *boidMotions[b];
+        boidSoA.boid[slot] = b;
+        boidSoA.px[slot] = motion.position.x;
+        boidSoA.py[slot] = motion.position.y;
+        boidSoA.vx[slot] = motion.velocity.x;
+        boidSoA.vy[slot] = motion.velocity.y;
+        boidSoA.speed[slot] = motion.speed;
+        uint32_t agent = boidAgents[b];
+        bool detected = (perception.flags[agent] & Perception::Detected) != 0;
+        boidSoA.chaseX[slot] = detected ? perception.dirX[agent] : 0;
+        boidSoA.chaseY[slot] = detected ? perception.dirY[agent] : 0;
+    }
+
+    if (flockBoids) {
+        BuildBoidFlocks();
+    }
+
+    const float* px = boidSoA.px.data();
+    const float* py = boidSoA.py.data();
+    const float* vx = boidSoA.vx.data();
+    const float* vy = boidSoA.vy.data();
+    const float groupRadiusSq = BOID_GROUPING_RADIUS * BOID_GROUPING_RADIUS;
+    const float separateRadiusSq = BOID_SEPARATE_RADIUS * BOID_SEPARATE_RADIUS;
+
+    for (size_t i = 0; i < n; i++) {
+        float x = px[i], y = py[i];
+        float groupCount = 0, posSumX = 0, posSumY = 0, velSumX = 0, velSumY = 0;
+        float separateCount = 0, sepSumX = 0, sepSumY = 0;
+        // a bat in a flock only needs the neighbours it separates from
+        int flock = flockBoids ? boidFlocks.flockOfSlot[i] : -1;
+        float queryRadius = flock >= 0 ? BOID_SEPARATE_RADIUS : BOID_GROUPING_RADIUS;
+
+        boidGrid.QueryRanges(vec2(x, y), queryRadius, [&](size_t begin, size_t end) {
+            AI_PROFILE_COUNT(neighborPairsTested, end - begin);
+            // branchless so the compiler can vectorize the reduction
+            for (size_t j = begin; j < end; j++) {
+                float dx = px[j] - x;
+                float dy = py[j] - y;
+                float distSq = dx * dx + dy * dy;
+                float inGroup = distSq <= groupRadiusSq ? 1.f : 0.f;
+                float inSeparate = distSq <= separateRadiusSq ? 1.f : 0.f;
+                groupCount += inGroup;
+                posSumX += inGroup * px[j];
+                posSumY += inGroup * py[j];
+                velSumX += inGroup * vx[j];
+                velSumY += inGroup * vy[j];
+                separateCount += inSeparate;
+                sepSumX += inSeparate * dx;
+                sepSumY += inSeparate * dy;
+            }
+        });
+
+        // the loop above counted the bat itself; take it back out (its separation term is zero)
+        groupCount -= 1; posSumX -= x; posSumY -= y; velSumX -= vx[i]; velSumY -= vy[i];
+        separateCount -= 1;
+        if (flock >= 0) {
+            // the rest of the flock stands in for the bats within BOID_GROUPING_RADIUS
+            groupCount = boidFlocks.count[flock] - 1;
+            posSumX = boidFlocks.sumPx[flock] - x;
+            posSumY = boidFlocks.sumPy[flock] - y;
+            velSumX = boidFlocks.sumVx[flock] - vx[i];
+            velSumY = boidFlocks.sumVy[flock] - vy[i];
+        }
+
+        float speed = boidSoA.speed[i];
+        vec2 steer = {0, 0};
+        if (groupCount > 1) {
+            float inv = 1.f / (groupCount - 1);
+            steer += (vec2(posSumX * inv, posSumY * inv) - vec2(x, y)) * BOID_GROUP_RATIO / vec2(50, 50);
+            steer += aimath::NormalizeClamped(vec2(velSumX * inv - vx[i], velSumY * inv - vy[i])) * speed * BOID_MATCH_RATIO / vec2(50, 50);
+        }
+        if (separateCount > 1) {
+            float inv = 1.f / (separateCount - 1);
+            steer += aimath::NormalizeClamped(vec2(sepSumX * inv, sepSumY * inv)) * speed * -BOID_SEPERATE_RATIO;
+        }
+
+        vec2 chase = vec2(boidSoA.chaseX[i], boidSoA.chaseY[i]);
+        if (chase.x != 0 || chase.y != 0) {
+            steer += chase * speed * BOID_CHASE_RATIO;
+        }
+
+        vec2 newVel = vec2(vx[i], vy[i]) + steer / vec2(40, 40);
+        boidSoA.newVelocity[i] = aimath::NormalizeClamped(vec2(newVel.x, newVel.y)) * speed;
+    }
+
+    // scatter
+    for (size_t slot = 0; slot < n; slot++) {
+        uint32_t b = boidSoA.boid[slot];
+        Motion& motion = *boidMotions[b];
+        motion.velocity = boidSoA.newVelocity[slot];
+        if (!(perception.flags[boidAgents[b]] & Perception::Detected)) {
+            AdjustVelocityForWalls(motion);
+        }
+    }
+}
+
+int AISystem::BoidFlocks::Find(int cell) {
+    while (parent[cell] != cell) {
+        parent[cell] = parent[parent[cell]];
+        cell = parent[cell];
+    }
+    return cell;
 }
 
-void AISystem::MoveBoid(Entity& entity) {
+void AISystem::BoidFlocks::Union(int a, int b) {
+    a = Find(a);
+    b = Find(b);
+    if (a == b) return;
+    if (std::max(maxX[a], maxX[b]) - std::min(minX[a], minX[b]) >= FLOCK_MAX_CELLS ||
+        std::max(maxY[a], maxY[b]) - std::min(minY[a], minY[b]) >= FLOCK_MAX_CELLS) return;
+    // the lower cell stays root so flock ids only depend on which cells are joined
+    if (b < a) std::swap(a, b);
+    parent[b] = a;
+    minX[a] = std::min(minX[a], minX[b]);
+    maxX[a] = std::max(maxX[a], maxX[b]);
+    minY[a] = std::min(minY[a], minY[b]);
+    maxY[a] = std::max(maxY[a], maxY[b]);
+}
+
+// Groups boidSoA (already in grid slot order) into flocks. One pass finds the occupied cells, each dense cell is joined
+// with the dense cells after it in key order (right, and the three below) as long as the flock stays compact, then one
+// more pass sums every flock.
+void AISystem::BuildBoidFlocks() {
+    AI_PROFILE_SCOPE("BuildBoidFlocks");
+    BoidFlocks& f = boidFlocks;
+    size_t n = boidGrid.size();
+    f.cellKey.clear();
+    f.cellStart.clear();
+    f.cellCount.clear();
+    for (size_t slot = 0; slot < n; slot++) {
+        uint64_t key = boidGrid.CellKeyAt(slot);
+        if (f.cellKey.empty() || f.cellKey.back() != key) {
+            f.cellKey.push_back(key);
+            f.cellStart.push_back((uint32_t)slot);
+            f.cellCount.push_back(0);
+        }
+        f.cellCount.back()++;
+    }
+
+    size_t cells = f.cellKey.size();
+    f.parent.resize(cells);
+    f.minX.resize(cells); f.maxX.resize(cells);
+    f.minY.resize(cells); f.maxY.resize(cells);
+    for (size_t c = 0; c < cells; c++) {
+        int x, y;
+        SpatialGrid::CellCoords(f.cellKey[c], x, y);
+        f.parent[c] = (int)c;
+        f.minX[c] = f.maxX[c] = x;
+        f.minY[c] = f.maxY[c] = y;
+    }
+
+    const int NEIGHBOR_OFFSETS[4][2] = { {1, 0}, {-1, 1}, {0, 1}, {1, 1} };
+    for (size_t c = 0; c < cells; c++) {
+        if (f.cellCount[c] < FLOCK_MIN_CELL_BATS) continue;
+        int x, y;
+        SpatialGrid::CellCoords(f.cellKey[c], x, y);
+        for (auto& offset : NEIGHBOR_OFFSETS) {
+            uint64_t key = SpatialGrid::CellKey(x + offset[0], y + offset[1]);
+            auto it = std::lower_bound(f.cellKey.begin() + c + 1, f.cellKey.end(), key);
+            if (it == f.cellKey.end() || *it != key) continue;
+            size_t other = it - f.cellKey.begin();
+            if (f.cellCount[other] >= FLOCK_MIN_CELL_BATS) f.Union((int)c, (int)other);
+        }
+    }
+
+    f.count.assign(cells, 0);
+    f.sumPx.assign(cells, 0); f.sumPy.assign(cells, 0);
+    f.sumVx.assign(cells, 0); f.sumVy.assign(cells, 0);
+    f.flockOfSlot.assign(n, -1);
+    for (size_t c = 0; c < cells; c++) {
+        if (f.cellCount[c] < FLOCK_MIN_CELL_BATS) continue;
+        int root = f.Find((int)c);
+        for (uint32_t slot = f.cellStart[c]; slot < f.cellStart[c] + f.cellCount[c]; slot++) {
+            f.count[root] += 1;
+            f.sumPx[root] += boidSoA.px[slot];
+            f.sumPy[root] += boidSoA.py[slot];
+            f.sumVx[root] += boidSoA.vx[slot];
+            f.sumVy[root] += boidSoA.vy[slot];
+            f.flockOfSlot[slot] = root;
+        }
+    }
+}
+
+void AISystem::MoveBoid(uint32_t agent) {
+    AI_PROFILE_SCOPE("MoveBoid");
+    Entity& entity = agents.entities[agent];
     vec2 groupVector = GroupBoid(entity);
     vec2 separateVector = SeparateBoid(entity);
     vec2 matchVelocityVector = MatchVelocityBoid(entity);
-    vec2 chaseVector = ChasePlayerBoid(entity);
+    vec2 chaseVector = ChasePlayerBoid(agent);
 
     Motion& boidMotion = registry.motions.get(entity);
     vec2 newVel = boidMotion.velocity + (groupVector + separateVector + matchVelocityVector + chaseVector) / vec2(40, 40);
@@ -193,9 +1570,7 @@ void AISystem::MoveBoid(Entity& entity) {
     newVel = Normalize(newVel) * vec2(boidMotion.speed, boidMotion.speed);
     boidMotion.velocity = newVel;
 
-    Motion& playerMotion = registry.motions.get(playerEntity);
-    HasAI& ai = registry.hasAIs.get(entity);
-    if (!IsNearby(playerMotion, boidMotion, ai.detectionRadius)) {
+    if (!(perception.flags[agent] & Perception::Detected)) {
         AvoidWallsBoid(entity);
     }
 }
@@ -205,12 +1580,12 @@ vec2 AISystem::GroupBoid(Entity& entity) {
     vec2 averagePos = {0, 0};
     Motion& entityMotion = registry.motions.get(entity);
 
-    for (Entity otherEntity : registry.hasAIs.entities) {
-        if (ShouldConsiderForGrouping(otherEntity, entity)) {
+    boidGrid.Query(entityMotion.position, BOID_GROUPING_RADIUS, [&](uint32_t otherBoid) {
+        if (ShouldConsiderForGrouping(otherBoid, entity, entityMotion)) {
             batCount++;
-            averagePos += registry.motions.get(otherEntity).position;
+            averagePos += boidMotions[otherBoid]->position;
         }
-    }
+    });
 
     return (batCount > 1) ? CalculateGroupVector(entityMotion, averagePos, batCount) : vec2(0, 0);
 }
@@ -220,12 +1595,12 @@ vec2 AISystem::SeparateBoid(Entity& entity) {
     vec2 endVelocity = {0, 0};
     Motion& entityMotion = registry.motions.get(entity);
 
-    for (Entity otherEntity : registry.hasAIs.entities) {
-        if (ShouldSeparateFrom(otherEntity, entity)) {
-            endVelocity -= (entityMotion.position - registry.motions.get(otherEntity).position);
+    boidGrid.Query(entityMotion.position, BOID_SEPARATE_RADIUS, [&](uint32_t otherBoid) {
+        if (ShouldSeparateFrom(otherBoid, entity, entityMotion)) {
+            endVelocity -= (entityMotion.position - boidMotions[otherBoid]->position);
             batCount++;
         }
-    }
+    });
 
     return (batCount > 1) ? CalculateSeparateVector(entityMotion, endVelocity, batCount) : vec2(0, 0);
 }
@@ -235,26 +1610,24 @@ vec2 AISystem::MatchVelocityBoid(Entity& entity) {
     vec2 averageVelocity = {0, 0};
     Motion& entityMotion = registry.motions.get(entity);
 
-    for (Entity otherEntity : registry.hasAIs.entities) {
-        if (ShouldConsiderForGrouping(otherEntity, entity)) {
+    boidGrid.Query(entityMotion.position, BOID_GROUPING_RADIUS, [&](uint32_t otherBoid) {
+        if (ShouldConsiderForGrouping(otherBoid, entity, entityMotion)) {
             batCount++;
-            averageVelocity += registry.motions.get(otherEntity).velocity;
+            // read through the pointer so bats already moved this frame are matched with their new velocity
+            averageVelocity += boidMotions[otherBoid]->velocity;
         }
-    }
+    });
 
     return (batCount > 1) ? CalculateMatchVelocityVector(entityMotion, averageVelocity, batCount) : vec2(0, 0);
 }
 
-vec2 AISystem::ChasePlayerBoid(Entity& entity) {
-    Motion& entityMotion = registry.motions.get(entity);
-    Motion& playerMotion = registry.motions.get(playerEntity);
-    HasAI& ai = registry.hasAIs.get(entity);
-
-    if (!IsNearby(entityMotion, playerMotion, ai.detectionRadius)) {
+vec2 AISystem::ChasePlayerBoid(uint32_t agent) {
+    if (!(perception.flags[agent] & Perception::Detected)) {
         return vec2(0, 0);
     }
 
-    return CalculateChaseVector(entityMotion, playerMotion, ai);
+    float speed = agents.motion[agent]->speed;
+    return vec2(perception.dirX[agent], perception.dirY[agent]) * speed * BOID_CHASE_RATIO;
 }
 
 void AISystem::AvoidWallsBoid(Entity& entity) {
@@ -268,13 +1641,21 @@ vec2 AISystem::CalculateMatchVelocityVector(Motion& entityMotion, vec2 averageVe
     return Normalize(averageVelocity - entityMotion.velocity) * vec2(entityMotion.speed, entityMotion.speed) * BOID_MATCH_RATIO / vec2(50, 50);
 }
 
-vec2 AISystem::CalculateChaseVector(Motion& entityMotion, Motion& playerMotion, HasAI& ai) {
-    vec2 diff = playerMotion.position - entityMotion.position;
-    float ratio = entityMotion.speed / sqrt(pow(diff.x, 2) + pow(diff.y, 2));
-    return vec2(ratio * diff.x, ratio * diff.y) * vec2(BOID_CHASE_RATIO, BOID_CHASE_RATIO);
-}
-
 void AISystem::AdjustVelocityForWalls(Motion& entityMotion) {
+    if (wallField.HasWalls()) {
+        float wallDistance;
+        vec2 normal;
+        wallField.Sample(entityMotion.position, wallDistance, normal);
+        // also true inside a wall, where the distance is negative
+        if (wallDistance < BOID_WALL_AVOID_DIST) {
+            // keep the motion along the wall, replace the part going into it with full speed out of it
+            float into = entityMotion.velocity.x * normal.x + entityMotion.velocity.y * normal.y;
+            entityMotion.velocity += normal * (entityMotion.speed - into);
+        }
+        return;
+    }
+
+    // no level loaded, or one without walls: the window edges are the walls
     float dx = windowWidthPx - entityMotion.position.x;
     float dy = windowHeightPx - entityMotion.position.y;
 
@@ -291,24 +1672,17 @@ void AISystem::AdjustVelocityForWalls(Motion& entityMotion) {
     }
 }
 
-bool AISystem::ShouldConsiderForGrouping(Entity otherEntity, Entity entity) {
-    Motion& otherEntityMotion = registry.motions.get(otherEntity);
-    HasAI& otherEntityAI = registry.hasAIs.get(otherEntity);
-    Motion& entityMotion = registry.motions.get(entity);
-
-    return otherEntity != entity &&
-           otherEntityAI.type == AIType::Bat &&
-           IsNearby(otherEntityMotion, entityMotion, BOID_GROUPING_RADIUS);
+// the grid only holds bats, so the type check happens once in BuildBoidGrid
+bool AISystem::ShouldConsiderForGrouping(uint32_t otherBoid, Entity entity, Motion& entityMotion) {
+    AI_PROFILE_COUNT(neighborPairsTested, 1);
+    return boidEntities[otherBoid] != entity &&
+           IsNearby(*boidMotions[otherBoid], entityMotion, BOID_GROUPING_RADIUS);
 }
 
-bool AISystem::ShouldSeparateFrom(Entity otherEntity, Entity entity) {
-    Motion& otherEntityMotion = registry.motions.get(otherEntity);
-    HasAI& otherEntityAI = registry.hasAIs.get(otherEntity);
-    Motion& entityMotion = registry.motions.get(entity);
-
-    return otherEntity != entity &&
-           otherEntityAI.type == AIType::Bat &&
-           IsNearby(entityMotion, otherEntityMotion, 50);
+bool AISystem::ShouldSeparateFrom(uint32_t otherBoid, Entity entity, Motion& entityMotion) {
+    AI_PROFILE_COUNT(neighborPairsTested, 1);
+    return boidEntities[otherBoid] != entity &&
+           IsNearby(entityMotion, *boidMotions[otherBoid], BOID_SEPARATE_RADIUS);
 }
 
 vec2 AISystem::CalculateGroupVector(Motion& entityMotion, vec2 averagePos, int batCount) {
@@ -322,26 +1696,381 @@ vec2 AISystem::CalculateSeparateVector(Motion& entityMotion, vec2 endVelocity, i
 }
 
 vec2 AISystem::Normalize(vec2 vector) {
-    float magnitude = sqrt(pow(vector.x, 2) + pow(vector.y, 2));
-    magnitude = std::max(0.001f, magnitude);
-    return vector / vec2(magnitude, magnitude);
+    return aimath::NormalizeClamped(vector);
+}
+
+void CompiledTree::compile(const std::vector<Node*>& treeNodes)
+{
+    nodes.clear();
+    children.clear();
+
+    for (Node* node : treeNodes) {
+        CompiledNode compiledNode;
+        compiledNode.type = node->getType();
+        compiledNode.parent = (uint16_t)node->getParent()->index;
+        compiledNode.firstChild = (uint16_t)children.size();
+        compiledNode.childCount = 0;
+
+        if (CompositeNode* composite = dynamic_cast<CompositeNode*>(node)) {
+            for (Node* child : composite->getChildren()) {
+                children.push_back((uint16_t)child->index);
+                compiledNode.childCount++;
+            }
+        }
+        nodes.push_back(compiledNode);
+    }
+}
+
+// Mirrors Selector::run, Sequence::run and LeafNode::finish, with node states kept in the entity's BehaviorState
+int CompiledTree::tick(int nodeIndex, AIStatus* status) const
+{
+    AI_PROFILE_COUNT(nodesVisited, 1);
+    const CompiledNode& node = nodes[nodeIndex];
+    NodeState* states = status->behavior->nodeStates;
+    NodeState leafState;
+
+    switch (node.type) {
+    case NodeType::Selector:
+        for (int i = node.firstChild; i < node.firstChild + node.childCount; i++) {
+            int child = children[i];
+            int childNext = tick(child, status);
+            if (states[child] == NodeState::True) {
+                states[nodeIndex] = NodeState::True;
+                return node.parent;
+            } else if (states[child] == NodeState::Running) {
+                states[nodeIndex] = NodeState::Running;
+                return childNext;
+            }
+        }
+        states[nodeIndex] = NodeState::False;
+        return node.parent;
+
+    case NodeType::Sequence:
+        for (int i = node.firstChild; i < node.firstChild + node.childCount; i++) {
+            int child = children[i];
+            int childNext = tick(child, status);
+            if (states[child] == NodeState::False) {
+                states[nodeIndex] = NodeState::False;
+                return node.parent;
+            }
+            if (states[child] == NodeState::Running) {
+                states[nodeIndex] = NodeState::Running;
+                return childNext;
+            }
+        }
+        states[nodeIndex] = NodeState::True;
+        return node.parent;
+
+    case NodeType::Patrol:       leafState = Patrol::tick(status); break;
+    case NodeType::ChasePlayer:  leafState = ChasePlayer::tick(status); break;
+    case NodeType::AttackPlayer: leafState = AttackPlayer::tick(status); break;
+    case NodeType::StalkPlayer:  leafState = StalkPlayer::tick(status); break;
+    case NodeType::TimedPatrol:  leafState = TimedPatrol::tick(status); break;
+    case NodeType::TimedStalkPlayer:  leafState = TimedStalkPlayer::tick(status); break;
+    case NodeType::TimedAttackPlayer: leafState = TimedAttackPlayer::tick(status); break;
+    default:                     leafState = NodeState::False; break;
+    }
+
+    states[nodeIndex] = leafState;
+    return leafState == NodeState::Running ? nodeIndex : node.parent;
+}
+
+bool CompiledTree::matches(const TreeDefinition& definition) const
+{
+    if (definition.size() != nodes.size()) return false;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if ((uint8_t)nodes[i].type != definition[i].type || nodes[i].childCount != definition[i].childCount) return false;
+    }
+    return true;
 }
 
 AISystem::AISystem()
 {
-    status = new AIStatus();
+    // one OS entropy read per AISystem, games stay different unless a seed is set
+    SetRandomSeed(std::random_device{}());
+
+    LoadBehaviorTrees();
+}
+
+static Node* CreateNodeOfType(TreeArena& arena, NodeType type)
+{
+    switch (type) {
+    case NodeType::Selector:     return arena.create<Selector>();
+    case NodeType::Sequence:     return arena.create<Sequence>();
+    case NodeType::Patrol:       return arena.create<Patrol>();
+    case NodeType::ChasePlayer:  return arena.create<ChasePlayer>();
+    case NodeType::AttackPlayer: return arena.create<AttackPlayer>();
+    case NodeType::StalkPlayer:  return arena.create<StalkPlayer>();
+    case NodeType::TimedPatrol:  return arena.create<TimedPatrol>();
+    case NodeType::TimedStalkPlayer:  return arena.create<TimedStalkPlayer>();
+    case NodeType::TimedAttackPlayer: return arena.create<TimedAttackPlayer>();
+    }
+    return nullptr;
+}
+
+// definitions are validated on load, so every composite gets exactly the children it asks for
+void BehaviorTree::build(const TreeDefinition& definition)
+{
+    arena.clear();
+    Node* newRoot = nullptr;
+    // composites still waiting for children, with how many are left
+    std::vector<std::pair<CompositeNode*, int>> open;
+
+    for (const TreeNodeDef& nodeDef : definition) {
+        Node* node = CreateNodeOfType(arena, (NodeType)nodeDef.type);
+        if (open.empty()) {
+            newRoot = node;
+            node->setParent(node);
+        } else {
+            CompositeNode* parent = open.back().first;
+            node->setParent(parent);
+            parent->addChild(node);
+            if (--open.back().second == 0) open.pop_back();
+        }
+        if (nodeDef.childCount > 0) {
+            open.push_back({ static_cast<CompositeNode*>(node), nodeDef.childCount });
+        }
+    }
+    setRoot(newRoot);
+}
+
+// Trees come from the data files when present (binary first, then the text source) and fall back to the
+// built-in construction functions for any AI type the files don't define
+void AISystem::LoadBehaviorTrees()
+{
+    BehaviorTreeLibrary library;
+    if (!library.LoadFile(data_path() + "/ai/behavior_trees.bin")) {
+        library.LoadFile(data_path() + "/ai/behavior_trees.txt");
+    }
+
+    std::vector<BehaviorTree*> libraryTrees(library.getTrees().size(), nullptr);
+    auto fromLibrary = [&](const char* name) -> BehaviorTree* {
+        int index = library.FindIndex(name);
+        if (index < 0) return nullptr;
+        if (!libraryTrees[index]) {
+            trees.push_back(std::make_unique<BehaviorTree>());
+            trees.back()->build(library.getTrees()[index]);
+            libraryTrees[index] = trees.back().get();
+        }
+        return libraryTrees[index];
+    };
+    auto builtIn = [&](Node* (AISystem::*create)(TreeArena&)) {
+        trees.push_back(std::make_unique<BehaviorTree>());
+        BehaviorTree* tree = trees.back().get();
+        tree->setRoot((this->*create)(tree->arena));
+        return tree;
+    };
+
+    skeletonTree = fromLibrary("skeleton");
+    if (!skeletonTree) skeletonTree = builtIn(&AISystem::CreateSkeletonBehaviorTree);
+    goblinTree = fromLibrary("goblin");
+    if (!goblinTree) goblinTree = builtIn(&AISystem::CreateGoblinBehaviorTree);
+    mushroomTree = fromLibrary("mushroom");
+    if (!mushroomTree) mushroomTree = builtIn(&AISystem::CreateMushroomBehaviorTree);
+
+    AttachStaticTrees();
+}
+
+template <typename Root>
+static void AttachStaticTree(BehaviorTree& tree, const TreeDefinition& definition)
+{
+    if (!tree.staticTick && tree.compiled.matches(definition)) tree.staticTick = &bt::Tree<Root>::tick;
+}
+
+// Checked by shape rather than by AI type, so a data file that gives mushrooms the goblin tree still gets a static tick
+void AISystem::AttachStaticTrees()
+{
+    TreeDefinition skeleton = bt::Tree<SkeletonTreeType>::definition();
+    TreeDefinition goblin = bt::Tree<GoblinTreeType>::definition();
+    TreeDefinition untimedSkeleton = bt::Tree<UntimedSkeletonTreeType>::definition();
+    TreeDefinition untimedGoblin = bt::Tree<UntimedGoblinTreeType>::definition();
+    for (auto& tree : trees) {
+        AttachStaticTree<SkeletonTreeType>(*tree, skeleton);
+        AttachStaticTree<GoblinTreeType>(*tree, goblin);
+        AttachStaticTree<UntimedSkeletonTreeType>(*tree, untimedSkeleton);
+        AttachStaticTree<UntimedGoblinTreeType>(*tree, untimedGoblin);
+    }
+}
+
+void AISystem::SetRandomSeed(uint64_t seed)
+{
+    random.setSeed(seed);
+    frameIndex = 0;
+}
+
+bool AISystem::StartRecording(const std::string& path)
+{
+    StopRecording();
+    return recorder.Open(path, random.getSeed());
+}
+
+void AISystem::StopRecording()
+{
+    recorder.Close();
+}
+
+void AISystem::CaptureFrame(float elapsedMs, AIFrameRecord& frame)
+{
+    frame.frameIndex = frameIndex;
+    frame.elapsedMs = elapsedMs;
+    frame.aiTimeMs = aiTimeMs;
+    frame.targets.clear();
+    frame.agents.clear();
+
+    // the same targets AITargetTable::Build will find, in the same order
+    auto addTarget = [&](Entity entity, bool player) {
+        if (!registry.motions.has(entity)) return;
+        Motion& motion = registry.motions.get(entity);
+        AITargetRecord target;
+        target.player = player;
+        target.dying = registry.deathTimers.has(entity);
+        target.position = motion.position;
+        target.velocity = motion.velocity;
+        target.speed = motion.speed;
+        frame.targets.push_back(target);
+    };
+    for (Entity player : registry.players.entities) addTarget(player, true);
+    for (Entity decoy : decoys) addTarget(decoy, false);
+
+    for (Entity entity : registry.hasAIs.entities) {
+        HasAI& ai = registry.hasAIs.get(entity);
+        Motion& motion = registry.motions.get(entity);
+        AIAgentRecord agent;
+        agent.id = RandomKey(entity);
+        agent.type = (uint8_t)ai.type;
+        // still in registry order, which is the order replays rebuild the registry in
+        int index = agents.IndexOf(entity);
+        // a type change nobody reported yet - Sync will start the agent's new tree from the root
+        if (index >= 0 && agents.type[index] != ai.type) index = -1;
+        BehaviorState behavior = index >= 0 ? agents.behavior[index] : BehaviorState();
+        agent.cursor = (uint8_t)behavior.currentNode;
+        agent.attacking = behavior.wantsAttack;
+        agent.taskStep = behavior.taskStep;
+        agent.taskWakeMs = behavior.taskWakeMs;
+        agent.cooldownEndMs = behavior.cooldownEndMs;
+        agent.position = motion.position;
+        agent.velocity = motion.velocity;
+        agent.speed = motion.speed;
+        agent.detectionRadius = ai.detectionRadius;
+        agent.attackRadius = registry.enemies.get(entity).attackRadius;
+        agent.attackCooldown = registry.enemies.get(entity).attackCoolDown;
+        frame.agents.push_back(agent);
+    }
+}
+
+// Rebuilds the registry from scratch for one recorded frame, entities in recorded order so the registry layout matches
+void AISystem::RestoreFrame(const AIFrameRecord& frame)
+{
+    registry.clear_all_components();
+    agents.Clear();
+#ifdef AI_COROUTINES
+    taskPool.Clear();
+#endif
+    attackStates.clear();
+    replayIds.clear();
+    decoys.clear();
+    // sleep isn't recorded - every agent starts the frame awake, which gives the same result as sleeping through it
+    ClearWakeups();
+    aiTimeMs = frame.aiTimeMs;
+
+    for (const AITargetRecord& target : frame.targets) {
+        Entity entity;
+        Motion& motion = registry.motions.emplace(entity);
+        motion.position = target.position;
+        motion.velocity = target.velocity;
+        motion.speed = target.speed;
+        if (target.player) registry.players.emplace(entity);
+        else decoys.push_back(entity);
+        if (target.dying) registry.deathTimers.emplace(entity);
+    }
+
+    for (const AIAgentRecord& agent : frame.agents) {
+        Entity entity;
+        Motion& motion = registry.motions.emplace(entity);
+        motion.position = agent.position;
+        motion.velocity = agent.velocity;
+        motion.speed = agent.speed;
+        HasAI& ai = registry.hasAIs.emplace(entity);
+        ai.type = (AIType)agent.type;
+        ai.detectionRadius = agent.detectionRadius;
+        Enemy& enemy = registry.enemies.emplace(entity);
+        enemy.attackRadius = agent.attackRadius;
+        enemy.attackCoolDown = agent.attackCooldown;
+        OnAIAdded(entity);
+        // the timed leaves start their tasks again from the recorded progress
+        BehaviorState& behavior = agents.behavior[agents.IndexOf(entity)];
+        behavior.currentNode = agent.cursor;
+        behavior.wantsAttack = agent.attacking;
+        behavior.taskStep = agent.taskStep;
+        behavior.taskWakeMs = agent.taskWakeMs;
+        behavior.cooldownEndMs = agent.cooldownEndMs;
+        replayIds[entity] = agent.id;
+    }
+}
+
+// Hash of what the AI produced this frame: velocity, cursor and task progress of every AI entity and the set wanting to attack
+uint64_t AISystem::ComputeFrameHash()
+{
+    uint64_t hash = HASH_SEED;
+    std::vector<uint32_t> attacking;
+
+    for (Entity entity : registry.hasAIs.entities) {
+        uint32_t id = RandomKey(entity);
+        vec2 velocity = registry.motions.get(entity).velocity;
+        int index = agents.IndexOf(entity);
+        BehaviorState behavior = index >= 0 ? agents.behavior[index] : BehaviorState();
+        int cursor = behavior.currentNode;
+        hash = HashBytes(hash, &id, sizeof(id));
+        hash = HashBytes(hash, &velocity, sizeof(velocity));
+        hash = HashBytes(hash, &cursor, sizeof(cursor));
+        hash = HashBytes(hash, &behavior.taskStep, sizeof(behavior.taskStep));
+        hash = HashBytes(hash, &behavior.taskWakeMs, sizeof(behavior.taskWakeMs));
+        hash = HashBytes(hash, &behavior.cooldownEndMs, sizeof(behavior.cooldownEndMs));
+        if (behavior.wantsAttack) attacking.push_back(id);
+    }
+
+    std::sort(attacking.begin(), attacking.end());
+    return HashBytes(hash, attacking.data(), attacking.size() * sizeof(uint32_t));
+}
+
+AIReplayResult AISystem::Replay(const std::string& path)
+{
+    AIReplayResult result;
+    AIReplayReader reader;
+    if (!reader.Open(path)) return result;
+    result.loaded = true;
+
+    StopRecording();
+    SetRandomSeed(reader.getSeed());
+
+    AIFrameRecord frame;
+    while (reader.ReadFrame(frame)) {
+        RestoreFrame(frame);
+        frameIndex = frame.frameIndex;
+        RunAI(frame.elapsedMs);
+
+        if (result.firstMismatch < 0 && ComputeFrameHash() != frame.hash) {
+            result.firstMismatch = frame.frameIndex;
+        }
+        result.frames++;
+    }
 
-    skeletonCurrentNode = CreateSkeletonBehaviorTree();
-    goblinCurrentNode = CreateGoblinBehaviorTree();
-    mushroomCurrentNode = CreateMushroomBehaviorTree();
+    registry.clear_all_components();
+    agents.Clear();
+#ifdef AI_COROUTINES
+    taskPool.Clear();
+#endif
+    replayIds.clear();
+    decoys.clear();
+    return result;
 }
 
 //Tree creation functions
-Node* AISystem::CreateSkeletonBehaviorTree() {
-    Selector* root = CreateRootNode();
+Node* AISystem::CreateSkeletonBehaviorTree(TreeArena& arena) {
+    Selector* root = CreateRootNode(arena);
 
-    Patrol* patrol = CreatePatrolNode(root);
-    Sequence* chaseSequence = CreateChaseSequenceNode(root, {new ChasePlayer(), new AttackPlayer()});
+    TimedPatrol* patrol = CreatePatrolNode(arena, root);
+    Sequence* chaseSequence = CreateChaseSequenceNode(arena, root);
 
     root->addChild(patrol);
     root->addChild(chaseSequence);
@@ -349,14 +2078,14 @@ Node* AISystem::CreateSkeletonBehaviorTree() {
     return root;
 }
 
-Node* AISystem::CreateGoblinBehaviorTree() {
-    Selector* root = CreateRootNode();
+Node* AISystem::CreateGoblinBehaviorTree(TreeArena& arena) {
+    Selector* root = CreateRootNode(arena);
 
-    Patrol* patrol = CreatePatrolNode(root);
-    Sequence* playerSpotSequence = CreateSequenceNode(root);
+    TimedPatrol* patrol = CreatePatrolNode(arena, root);
+    Sequence* playerSpotSequence = CreateSequenceNode(arena, root);
 
-    StalkPlayer* stalk = CreateStalkPlayerNode(playerSpotSequence);
-    Sequence* chaseSequence = CreateChaseSequenceNode(playerSpotSequence, {new ChasePlayer(), new AttackPlayer()});
+    TimedStalkPlayer* stalk = CreateStalkPlayerNode(arena, playerSpotSequence);
+    Sequence* chaseSequence = CreateChaseSequenceNode(arena, playerSpotSequence);
 
     playerSpotSequence->addChild(stalk);
     playerSpotSequence->addChild(chaseSequence);
@@ -367,11 +2096,11 @@ Node* AISystem::CreateGoblinBehaviorTree() {
     return root;
 }
 
-Node* AISystem::CreateMushroomBehaviorTree() {
-    Selector* root = CreateRootNode();
+Node* AISystem::CreateMushroomBehaviorTree(TreeArena& arena) {
+    Selector* root = CreateRootNode(arena);
 
-    Patrol* patrol = CreatePatrolNode(root);
-    Sequence* chaseSequence = CreateChaseSequenceNode(root, {new ChasePlayer(), new AttackPlayer()});
+    TimedPatrol* patrol = CreatePatrolNode(arena, root);
+    Sequence* chaseSequence = CreateChaseSequenceNode(arena, root);
 
     root->addChild(patrol);
     root->addChild(chaseSequence);
@@ -380,41 +2109,40 @@ Node* AISystem::CreateMushroomBehaviorTree() {
 }
 
 //Tree creation helpers
-Selector* AISystem::CreateRootNode() {
-    Selector* root = new Selector();
+Selector* AISystem::CreateRootNode(TreeArena& arena) {
+    Selector* root = arena.create<Selector>();
     root->setParent(root);
     return root;
 }
 
-Patrol* AISystem::CreatePatrolNode(Node* parent) {
-    Patrol* patrol = new Patrol();
+TimedPatrol* AISystem::CreatePatrolNode(TreeArena& arena, Node* parent) {
+    TimedPatrol* patrol = arena.create<TimedPatrol>();
     patrol->setParent(parent);
-    patrol->setStatus(status);
     return patrol;
 }
 
-Sequence* AISystem::CreateChaseSequenceNode(Node* parent, std::initializer_list<Node*> children) {
-    Sequence* sequence = new Sequence();
+// Sequence{ChasePlayer, TimedAttackPlayer}
+Sequence* AISystem::CreateChaseSequenceNode(TreeArena& arena, Node* parent) {
+    Sequence* sequence = arena.create<Sequence>();
     sequence->setParent(parent);
 
+    Node* children[] = { arena.create<ChasePlayer>(), arena.create<TimedAttackPlayer>() };
     for (Node* child : children) {
         child->setParent(sequence);
-        child->setStatus(status);
         sequence->addChild(child);
     }
 
     return sequence;
 }
 
-Sequence* AISystem::CreateSequenceNode(Node* parent) {
-    Sequence* sequence = new Sequence();
+Sequence* AISystem::CreateSequenceNode(TreeArena& arena, Node* parent) {
+    Sequence* sequence = arena.create<Sequence>();
     sequence->setParent(parent);
     return sequence;
 }
 
-StalkPlayer* AISystem::CreateStalkPlayerNode(Node* parent) {
-    StalkPlayer* stalk = new StalkPlayer();
+TimedStalkPlayer* AISystem::CreateStalkPlayerNode(TreeArena& arena, Node* parent) {
+    TimedStalkPlayer* stalk = arena.create<TimedStalkPlayer>();
     stalk->setParent(parent);
-    stalk->setStatus(status);
     return stalk;
 }
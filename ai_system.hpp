@@ -6,11 +6,101 @@
 #include "tiny_ecs_registry.hpp"
 #include "common.hpp"
 #include "render_system.hpp"
+#include "spatial_grid.hpp"
+#include "ai_job_pool.hpp"
+#include "ai_random.hpp"
+#include "ai_replay.hpp"
+#include "ai_profiler.hpp"
+#include "tree_arena.hpp"
+#include "behavior_tree_loader.hpp"
+#include "ai_math.hpp"
+#include "ai_navigation.hpp"
+#include "ai_task.hpp"
 #include <random>
 using namespace std;
-#include <list>
+#include <cassert>
+#include <memory>
+#include <unordered_map>
+#include <queue>
+#include <functional>
 
 enum class NodeState {True, False, Running};
+// Tag for every concrete node class, used by the compiled trees to dispatch without virtual calls
+enum class NodeType {Selector, Sequence, Patrol, ChasePlayer, AttackPlayer, StalkPlayer, TimedPatrol, TimedStalkPlayer, TimedAttackPlayer};
+const int NODE_TYPE_COUNT = 9;
+inline bool IsCompositeType(NodeType type) {return type == NodeType::Selector || type == NodeType::Sequence;}
+
+// Max nodes in one behavior tree - per-entity state is a fixed array so it can live in a dense component
+const int MAX_BEHAVIOR_NODES = 16;
+
+// Per-entity execution state for a behavior tree. The trees themselves are shared and immutable while ticking,
+// every AI entity keeps its own cursor (the node to resume from) and the last state of each node.
+struct BehaviorState {
+	int currentNode = 0;
+	NodeState nodeStates[MAX_BEHAVIOR_NODES] = {};
+	// set by AttackPlayer while the player is in reach, cleared at the start of every tick - read by HandleEnemyAttacks
+	bool wantsAttack = false;
+	// the target (index into AISystem's target table) AttackPlayer went after when it set wantsAttack
+	int32_t attackTarget = -1;
+	// set with wantsAttack by TimedAttackPlayer, which times the cooldown itself instead of the attackCoolDown timer
+	bool cooldownInTree = false;
+	// slot in AISystem's AITaskPool of the coroutine a timed leaf is running for this entity, -1 for none
+	int32_t task = -1;
+	// How far the timed leaves have got, kept here rather than in the coroutine frame so replays can record it and a
+	// task started again from it carries on where the old one was: the step the task is on, the AI clock time its
+	// current wait ends (-1 when it isn't waiting), and when TimedAttackPlayer's cooldown ends
+	uint32_t taskStep = 0;
+	double taskWakeMs = -1;
+	double cooldownEndMs = 0;
+};
+
+// One enemy's attack cycle, advanced by HandleEnemyAttacks. The registry (enemyAttacks, attackCoolDown, the sprite)
+// is only written when the phase changes, not every frame the enemy spends in it.
+//   Idle -> Windup     AttackPlayer wants to attack - its target is kept in target for the rest of the cycle
+//   Windup -> Attack   no cooldown left and not dying: the attack is launched and the attack sprite shown
+//   Attack -> Cooldown the attack animation finished: back to the movement sprite
+//   Cooldown -> Idle   the cooldown timer ran out
+// Attacks asked for by TimedAttackPlayer (cooldownInTree) skip the attackCoolDown timer - the leaf only asks again
+// once its own cooldown is over.
+struct EnemyAttackState {
+	enum class Phase { Idle, Windup, Attack, Cooldown };
+	Phase phase = Phase::Idle;
+	Phase previous = Phase::Idle;
+	uint32_t transitionFrame = 0;  // frameIndex of the last transition
+	uint32_t transitions = 0;
+	Entity target;  // what the windup was aimed at, the attack goes there even if the tree picks another target
+	bool cooldownInTree = false;
+
+	explicit EnemyAttackState(Entity target) : target(target) {}
+};
+
+// Per-entity level of detail bookkeeping, see AISystem::levelOfDetail
+struct AILodState {
+	float pendingMs = 0;  // time since the entity last ticked
+	float tickMs = 0;     // time covered by the current tick, handed to the tree as AIStatus::elapsedMs
+	bool scheduled = false;
+	bool overdue = false; // was due but didn't fit in the frame budget, goes ahead of everything else next frame
+};
+
+// An agent left out of the tick until one of its wake conditions fires, see AISystem::eventWakeups
+struct AISleep {
+	enum class Reason { Patrol, Stalk };
+	Reason reason;
+	uint32_t generation;  // wake queue entries from earlier sleeps have an older generation and are ignored
+	double sleptAtMs;
+};
+
+// One wake condition in a queue, ordered by key (a frame, a time or a player travel distance depending on the queue)
+struct AIWakeEntry {
+	double key;
+	Entity entity;
+	uint32_t generation;
+	bool operator>(const AIWakeEntry& other) const {return key > other.key;}
+};
+
+// Where an agent stands in its stalk band (see StalkPlayer): further out than 0.6 of its detection radius, between
+// 0.55 and 0.6, or closer than 0.55
+enum class StalkBand : uint8_t { Approach, Hold, Retreat };
 
 // Struct that holds information as to whether there is an player nearby - we use this to pass in info from the AI system into the nodes
 struct AIStatus {
@@ -18,47 +108,132 @@ struct AIStatus {
 	bool playerAttackable = false;
 	bool shouldAttack = true;
 	Motion* aiMotion = nullptr;
-	Motion* playerMotion = nullptr;
 	Entity* aiEntity = nullptr;
-	Entity* playerEntity = nullptr;
+	BehaviorState* behavior = nullptr;
+	// the player (or decoy) this entity goes after this frame - an index into AISystem's target table and its position.
+	// The player fields below all refer to this target.
+	int target = -1;
+	vec2 targetPosition = { 0, 0 };
+	// squared distance and unit direction to the target, from AISystem's per-frame perception pass. The direction is
+	// (0, 0) for an entity standing on its target.
+	float playerDistSq = 0;
+	vec2 targetDirection = { 0, 0 };
+	StalkBand stalkBand = StalkBand::Approach;
+	// directions towards the target around walls, nullptr when AISystem::useFlowField is off or the flow field leads
+	// to a different target
+	const FlowField* flowField = nullptr;
+	// time since this entity's tree last ran - more than one frame for agents the LOD scheduler skipped
+	float elapsedMs = 0;
+	// the AI clock (AISystem::aiTimeMs) this frame, what timed leaves wait against
+	double timeMs = 0;
+	// Enemy::attackCoolDown, what TimedAttackPlayer waits between attacks
+	float attackCooldownMs = 0;
+#ifdef AI_COROUTINES
+	AITaskPool* tasks = nullptr;
+#endif
+	// for rolls that aren't tied to the frame (TimedPatrol's legs), keyed like rand and rand2
+	const AIRandom* random = nullptr;
+	uint32_t randomKey = 0;
 	//random ints from 1-1000 used for random behaviors 
 	int rand = 0;
 	int rand2 = 0;
 };
 
+// Leaves don't write to the registry while ticking - an attack is only asked for here and carried out by
+// HandleEnemyAttacks after every tree has run, which also keeps the parallel update free of shared writes
+inline void SetEnemyAttacking(AIStatus* status, bool attacking, bool cooldownInTree = false) {
+	status->behavior->wantsAttack = attacking;
+	status->behavior->attackTarget = attacking ? status->target : -1;
+	status->behavior->cooldownInTree = attacking && cooldownInTree;
+}
+
+#ifdef AI_COROUTINES
+// The ticking entity's task for a timed leaf: started from body if the entity has none, and resumed if what it waits
+// for has come. nullptr when every task slot is taken, the leaf falls back to its plain behavior then.
+inline AITask* RunTimedTask(AIStatus* status, AITask (*body)(AITaskFrame)) {
+	int32_t& slot = status->behavior->task;
+	AITask* task = status->tasks->Get(slot);
+	if (!task) task = status->tasks->Start(slot, body);
+	if (task && !task->done() && task->Ready(status)) task->Resume(status, status->timeMs);
+	return task;
+}
+#endif
+
+// Ends the ticking entity's task, if it has one, and drops the wait it was in. taskStep carries on counting.
+inline void EndTimedTask(AIStatus* status) {
+#ifdef AI_COROUTINES
+	status->tasks->Release(status->behavior->task);
+#endif
+	status->behavior->taskWakeMs = -1;
+}
+
+// Moves the ticking entity towards its target at the given speed - along the flow field when there is one,
+// straight at the target when there isn't or the entity is already in the target's tile
+inline void SteerTowardsPlayer(AIStatus* status, float speed) {
+	Motion* enemyMotion = status->aiMotion;
+	if (status->flowField) {
+		vec2 direction = status->flowField->DirectionAt(enemyMotion->position);
+		if (direction.x != 0 || direction.y != 0) {
+			enemyMotion->velocity = direction * speed;
+			return;
+		}
+	}
+	enemyMotion->velocity = status->targetDirection * speed;
+}
+
 class Node {  // This class represents each node in the behaviour tree.
 	public:
 		Node* parent;
-		virtual Node* run() = 0;
-		NodeState state;
+		int index = 0;  // pre-order position in the tree, used to look up per-entity state
+		virtual ~Node() = default;
+		virtual Node* run(AIStatus* status) = 0;
+		virtual NodeType getType() const = 0;
 		void setParent(Node* p) {parent = p;}
 		Node* getParent() {return parent;}
+		NodeState getState(AIStatus* status) {return status->behavior->nodeStates[index];}
+		void setState(AIStatus* status, NodeState state) {status->behavior->nodeStates[index] = state;}
 
 };
 
 class CompositeNode : public Node {  //  This type of Node follows the Composite Pattern, containing a list of other Nodes.
+	public:
+		static const int MAX_CHILDREN = 8;
+		// iterable view over the children, so callers can range-for over getChildren()
+		struct Children {
+			Node* const* first;
+			Node* const* last;
+			Node* const* begin() const {return first;}
+			Node* const* end() const {return last;}
+		};
 	private:
-		std::list<Node*> children;
+		// stored inline so the child pointers sit right next to the node in the tree's arena
+		Node* children[MAX_CHILDREN];
+		int childCount = 0;
 	public:
-		const std::list<Node*>& getChildren() const {return children;}
-		void addChild (Node* child) {children.emplace_back(child);}
+		Children getChildren() const {return {children, children + childCount};}
+		void addChild (Node* child) {
+			assert(childCount < MAX_CHILDREN);
+			children[childCount++] = child;
+		}
 };
 
 class Selector : public CompositeNode {
 	public:
-		Node* run()  {
+		NodeType getType() const {return NodeType::Selector;}
+		Node* run(AIStatus* status)  {
+			AI_PROFILE_COUNT(nodesVisited, 1);
 			for (Node* child : getChildren()) {  // The generic Selector implementation
-				Node* childNext = child->run();
-				if (child->state==NodeState::True) { // If one child succeeds, the entire operation run() succeeds.  Failure only results if all children fail.
-					this->state = NodeState::True;
+				Node* childNext = child->run(status);
+				if (child->getState(status)==NodeState::True) { // If one child succeeds, the entire operation run() succeeds.  Failure only results if all children fail.
+					setState(status, NodeState::True);
 					return this->parent;
 
-				} else if (child->state==NodeState::Running) { //If running, return the child that's still running
-					this->state = NodeState::Running;
+				} else if (child->getState(status)==NodeState::Running) { //If running, return the child that's still running
+					setState(status, NodeState::Running);
 					return childNext;
 				}
 			}
-			this->state = NodeState::False;
+			setState(status, NodeState::False);
 			return this->parent;  // All children failed so the entire run() operation fails.
 		}
 };
@@ -66,38 +241,50 @@ class Selector : public CompositeNode {
 
 class Sequence : public CompositeNode {
 	public:
-		Node* run()  {
+		NodeType getType() const {return NodeType::Sequence;}
+		Node* run(AIStatus* status)  {
+			AI_PROFILE_COUNT(nodesVisited, 1);
 			for (Node* child : getChildren()) {  // The generic Sequence implementation.
-				Node* childNext = child->run();
-				if (child->state==NodeState::False) { // If one child fails, then entire operation run() fails.  Success only results if all children succeed.
-					this->state = NodeState::False;
+				Node* childNext = child->run(status);
+				if (child->getState(status)==NodeState::False) { // If one child fails, then entire operation run() fails.  Success only results if all children succeed.
+					setState(status, NodeState::False);
 					return this->parent;
 				}
-				if (child->state==NodeState::Running) {
-					this->state = NodeState::Running;
+				if (child->getState(status)==NodeState::Running) {
+					setState(status, NodeState::Running);
 					return childNext;
 				}
 			}
-			this->state = NodeState::True;
+			setState(status, NodeState::True);
 			return this->parent;  // All children suceeded, so the entire run() operation succeeds.
 		}
 };
 
+// Leaves read and write the entity being ticked through the AIStatus passed into run().
+// The behavior itself lives in a static tick() so the compiled trees can call it directly.
 class LeafNode : public Node {
-	protected: 
-			AIStatus* status;
-	public:
-			AIStatus* getStatus() { return status;}
-			void setStatus(AIStatus* newStatus) {status = newStatus;}
+	protected:
+		// A running leaf is where the entity resumes next tick, otherwise control goes back up to the parent
+		Node* finish(AIStatus* status, NodeState state) {
+			AI_PROFILE_COUNT(nodesVisited, 1);
+			setState(status, state);
+			return state == NodeState::Running ? this : this->parent;
+		}
 };
 
 class Patrol : public LeafNode{
 	public:
-		Node* run() {
+		static const NodeType TYPE = NodeType::Patrol;
+		NodeType getType() const {return TYPE;}
+		Node* run(AIStatus* status) {return finish(status, tick(status));}
+
+		// whether a roll makes a patrolling mob stop or change direction, anything else leaves it as it is
+		static bool RollActs(int rand) {return rand >= 97 && rand <= 100;}
+
+		static NodeState tick(AIStatus* status) {
 			if (status->playerNearby) {
 				//If a player is nearby, fail and begin chasing
-				this->state = NodeState::False;
-				return this->parent;
+				return NodeState::False;
 			} else {
 				//randomly generate a number from 1 - 100 then perform an action based on the result:
 				// 1 - 80 does nothing, i.e. continue moving/waiting 
@@ -113,38 +300,91 @@ class Patrol : public LeafNode{
 					float yvel = ((status->rand2 % 10) - 4.5) * status->aiMotion->speed/9;
 					status->aiMotion->velocity = vec2(xvel,yvel);
 				}
-				this->state = NodeState::Running;
-				return this;
+				return NodeState::Running;
+			}
+		}
+};
+
+// Patrol without a roll every tick: walks a random way for a while, stands still for a while, and again - written as
+// a coroutine (see AITask), so each leg is decided once and the task sleeps until it's over. The legs are counted in
+// BehaviorState::taskStep and rolled from it rather than from the frame, so a replay can start the walk again mid-leg.
+// Builds without coroutines, or with every task slot taken, patrol with Patrol's rolls instead.
+class TimedPatrol : public LeafNode {
+	public:
+		static const NodeType TYPE = NodeType::TimedPatrol;
+		// AIRandom streams for the legs, clear of the per-frame rolls on 0 and 1
+		static const uint32_t LEG_STREAM = 2;
+		NodeType getType() const {return TYPE;}
+		Node* run(AIStatus* status) {return finish(status, tick(status));}
+
+		static NodeState tick(AIStatus* status) {
+			if (status->playerNearby) {
+				//If a player is nearby, fail and begin chasing - the walk starts over next time
+				EndTimedTask(status);
+				return NodeState::False;
+			}
+#ifdef AI_COROUTINES
+			if (RunTimedTask(status, &Walk)) return NodeState::Running;
+#endif
+			return Patrol::tick(status);
+		}
+
+		// Starts leg step and returns how long it lasts: even legs walk for 0.5 - 2.5s, slower than base speed like
+		// Patrol so mobs "run" at the player when spotting, odd legs stand for 0.5 - 1.5s
+		static float StartLeg(AIStatus* status, uint32_t step) {
+			int roll = status->random->Range(status->randomKey, step, LEG_STREAM, 1, 1000);
+			Motion* motion = status->aiMotion;
+			if (step % 2 == 1) {
+				motion->velocity = vec2(0, 0);
+				return 500.f + roll;
+			}
+			int roll2 = status->random->Range(status->randomKey, step, LEG_STREAM + 1, 1, 1000);
+			motion->velocity = vec2(((roll % 10) - 4.5f) * motion->speed / 9, ((roll2 % 10) - 4.5f) * motion->speed / 9);
+			return 500.f + 2.f * roll;
+		}
+
+#ifdef AI_COROUTINES
+		static AITask Walk(AITaskFrame) {
+			AIStatus* status = co_await ThisTick();
+			// a new walk starts with a walking leg, numbered on from the last walk so it doesn't repeat its rolls
+			if (status->behavior->taskWakeMs < 0) status->behavior->taskStep += status->behavior->taskStep % 2;
+			for (;;) {
+				BehaviorState* behavior = status->behavior;
+				if (behavior->taskWakeMs < 0) behavior->taskWakeMs = status->timeMs + StartLeg(status, behavior->taskStep);
+				// a walk started again from a replay may find its leg already over
+				if (behavior->taskWakeMs > status->timeMs) status = co_await ResumeAt(behavior->taskWakeMs);
+				status->behavior->taskWakeMs = -1;
+				status->behavior->taskStep++;
 			}
 		}
+#endif
 };
 
 class ChasePlayer : public LeafNode{
 	public:
-		Node* run()  {
+		static const NodeType TYPE = NodeType::ChasePlayer;
+		NodeType getType() const {return TYPE;}
+		Node* run(AIStatus* status) {return finish(status, tick(status));}
+
+		static NodeState tick(AIStatus* status)  {
 			Motion* enemyMotion = status->aiMotion;
-			Motion* playerMotion = status->playerMotion;
 
 			//Case 1: Enemy has reached player, return true and move to attack node
 			if (status->playerAttackable && status->shouldAttack) {
-				this->state = NodeState::True;
-				return this->parent;
+				return NodeState::True;
 
 			//Case 2: Enemy can see player but has not reached them, return running and keep chasing
 			} else if (status->playerNearby && status->shouldAttack) {
 
 				//move towards the player
-				float ratio = enemyMotion->speed / sqrt(pow(playerMotion->position.x - enemyMotion->position.x, 2) + pow(playerMotion->position.y - enemyMotion->position.y, 2));
-				enemyMotion->velocity = vec2(ratio * (playerMotion->position.x - enemyMotion->position.x), ratio * (playerMotion->position.y - enemyMotion->position.y));
+				SteerTowardsPlayer(status, enemyMotion->speed);
 
-				this->state = NodeState::Running;
-				return this;
+				return NodeState::Running;
 			//Case 3: Enemy has lost sight of player or should no longer be attacking, return to patrol loop
 			} else { 
 				//set velocity to half so enemies visibly stop "running" after losing the player
 				enemyMotion->velocity = enemyMotion->velocity/vec2(2,2);
-				this->state = NodeState::False;
-				return this->parent;
+				return NodeState::False;
 			}
 		}
 
@@ -152,16 +392,18 @@ class ChasePlayer : public LeafNode{
 
 class AttackPlayer : public LeafNode {
 public:
-	Node* run() {
+	static const NodeType TYPE = NodeType::AttackPlayer;
+	NodeType getType() const {return TYPE;}
+	Node* run(AIStatus* status) {return finish(status, tick(status));}
+
+	static NodeState tick(AIStatus* status) {
 		if (status->playerAttackable && status->shouldAttack) {
-			if (!registry.enemyAttacks.has(*status->aiEntity)) registry.enemyAttacks.emplace(*status->aiEntity);
-			this->state = NodeState::Running;
-			return this;
+			SetEnemyAttacking(status, true);
+			return NodeState::Running;
 		}
 		else {
-			if (registry.enemyAttacks.has(*status->aiEntity)) registry.enemyAttacks.remove(*status->aiEntity);
-			this->state = NodeState::False;
-			return this->parent;
+			SetEnemyAttacking(status, false);
+			return NodeState::False;
 		}
 	}
 };
@@ -171,88 +413,680 @@ public:
 // return "true" to initiate next behavior, otherwise maintain distance from player and return running
 class StalkPlayer : public LeafNode {
 public:
-	Node* run() {
-		Player& player = registry.players.get(*status->playerEntity);
-		float playerDist = sqrtf(pow((status->aiMotion->position.x-status->playerMotion->position.x), 2)  + pow((status->aiMotion->position.y - status->playerMotion->position.y), 2));
-		HasAI& ai = registry.hasAIs.get(*status->aiEntity);
+	static const NodeType TYPE = NodeType::StalkPlayer;
+	NodeType getType() const {return TYPE;}
+	Node* run(AIStatus* status) {return finish(status, tick(status));}
 
+	static NodeState tick(AIStatus* status) {
 		Motion* enemyMotion = status->aiMotion;
-		Motion* playerMotion = status->playerMotion;
 
 		if (status->shouldAttack) {
 			//if other enemy is nearby (and thus attacking) return true
-			this->state = NodeState::True;
-			return this->parent;	
+			return NodeState::True;	
 		}
 		// if player is no longer visible to the ai fail
 		if (!status->playerNearby) {
-			this->state = NodeState::False;
-			return this->parent;
+			return NodeState::False;
 		}
 		//player is visible, not vulnerable, but too far away - approach
-		if (playerDist > ai.detectionRadius * 0.6) {
+		if (status->stalkBand == StalkBand::Approach) {
 				//move towards the player
-				float ratio = enemyMotion->speed / sqrt(pow(playerMotion->position.x - enemyMotion->position.x, 2) + pow(playerMotion->position.y - enemyMotion->position.y, 2));
-				enemyMotion->velocity = vec2(ratio * (playerMotion->position.x - enemyMotion->position.x), ratio * (playerMotion->position.y - enemyMotion->position.y));
+				SteerTowardsPlayer(status, enemyMotion->speed);
 
-				this->state = NodeState::Running;
-				return this;
+				return NodeState::Running;
 
-		} else if (playerDist > ai.detectionRadius * 0.55 && playerDist <= ai.detectionRadius * 0.6) {
+		} else if (status->stalkBand == StalkBand::Hold) {
 			//Keep same position but face player
-				float ratio = 0.0001 / sqrt(pow(playerMotion->position.x - enemyMotion->position.x, 2) + pow(playerMotion->position.y - enemyMotion->position.y, 2));
-				enemyMotion->velocity = vec2(ratio * (playerMotion->position.x - enemyMotion->position.x), ratio * (playerMotion->position.y - enemyMotion->position.y));
-				this->state = NodeState::Running;
-				return this;	
-
-		} else if (playerDist <= ai.detectionRadius * 0.55) {
-				//move away from the player
-				float ratio = -enemyMotion->speed / sqrt(pow(playerMotion->position.x - enemyMotion->position.x, 2) + 
-														  pow(playerMotion->position.y - enemyMotion->position.y, 2));
-				enemyMotion->velocity = vec2(ratio * (playerMotion->position.x - enemyMotion->position.x), 
-											  ratio * (playerMotion->position.y - enemyMotion->position.y));
-				this->state = NodeState::Running;
-				return this;
+				enemyMotion->velocity = status->targetDirection * 0.0001f;
+				return NodeState::Running;	
+
+		}
+		//move away from the player
+		enemyMotion->velocity = status->targetDirection * -enemyMotion->speed;
+		return NodeState::Running;
+	}
+};
+
+// StalkPlayer with a windup: once another enemy engages, the goblin stands facing its target for WINDUP_MS before going
+// in, and goes back to stalking if the opening closes first. The windup is a task waiting on the AI clock.
+// Builds without coroutines, or with every task slot taken, go straight in like StalkPlayer.
+class TimedStalkPlayer : public LeafNode {
+public:
+	static const NodeType TYPE = NodeType::TimedStalkPlayer;
+	static constexpr float WINDUP_MS = 400;
+	NodeType getType() const {return TYPE;}
+	Node* run(AIStatus* status) {return finish(status, tick(status));}
+
+	static NodeState tick(AIStatus* status) {
+#ifdef AI_COROUTINES
+		if (status->shouldAttack) {
+			// brace facing the target, the same way the Hold band does
+			status->aiMotion->velocity = status->targetDirection * 0.0001f;
+			AITask* task = RunTimedTask(status, &Windup);
+			if (task && !task->done()) return NodeState::Running;
+			EndTimedTask(status);
+			return NodeState::True;
+		}
+		// called off - the next windup starts from the beginning
+		EndTimedTask(status);
+#endif
+		return StalkPlayer::tick(status);
+	}
+
+#ifdef AI_COROUTINES
+	static AITask Windup(AITaskFrame) {
+		AIStatus* status = co_await ThisTick();
+		BehaviorState* behavior = status->behavior;
+		if (behavior->taskWakeMs < 0) behavior->taskWakeMs = status->timeMs + WINDUP_MS;
+		if (behavior->taskWakeMs > status->timeMs) co_await ResumeAt(behavior->taskWakeMs);
+	}
+#endif
+};
+
+// AttackPlayer with the cooldown in the tree: asks for one attack, then waits out Enemy::attackCoolDown on the AI clock
+// before asking again. The attack cycle leaves the attackCoolDown timer out for these attacks, and the cooldown's end
+// (BehaviorState::cooldownEndMs) outlasts the task, so stepping out of reach and back doesn't skip it.
+// Builds without coroutines, or with every task slot taken, attack like AttackPlayer.
+class TimedAttackPlayer : public LeafNode {
+public:
+	static const NodeType TYPE = NodeType::TimedAttackPlayer;
+	NodeType getType() const {return TYPE;}
+	Node* run(AIStatus* status) {return finish(status, tick(status));}
+
+	static NodeState tick(AIStatus* status) {
+#ifdef AI_COROUTINES
+		if (!status->playerAttackable || !status->shouldAttack) {
+			EndTimedTask(status);
+			SetEnemyAttacking(status, false);
+			return NodeState::False;
+		}
+		if (RunTimedTask(status, &Strike)) return NodeState::Running;
+#endif
+		return AttackPlayer::tick(status);
+	}
+
+#ifdef AI_COROUTINES
+	static AITask Strike(AITaskFrame) {
+		AIStatus* status = co_await ThisTick();
+		for (;;) {
+			BehaviorState* behavior = status->behavior;
+			if (status->timeMs >= behavior->cooldownEndMs) {
+				SetEnemyAttacking(status, true, true);
+				behavior->cooldownEndMs = status->timeMs + status->attackCooldownMs;
+			}
+			status = co_await ResumeAt(behavior->cooldownEndMs);
 		}
-		//should never return here
-		printf("ERROR StalkPlayer defaulted!");
-		this->state = NodeState::False;
-		return this->parent;
 	}
+#endif
+};
+
+// Flat copy of a behavior tree: one small POD per node in pre-order, children stored as index ranges into one array.
+// Ticking it walks a couple of cache lines and switches on the node type instead of chasing pointers through virtual run() calls.
+struct CompiledNode {
+	NodeType type;
+	uint16_t parent;
+	uint16_t firstChild;  // into CompiledTree::children
+	uint16_t childCount;
+};
+
+struct CompiledTree {
+	std::vector<CompiledNode> nodes;
+	std::vector<uint16_t> children;
+
+	// nodes must be the tree in pre-order (BehaviorTree::nodes), so indices match the dynamic tree
+	void compile(const std::vector<Node*>& treeNodes);
+	// same semantics as Node::run - returns the index of the node to resume from next tick
+	int tick(int nodeIndex, AIStatus* status) const;
+	// true if this is the tree the definition describes, node for node
+	bool matches(const TreeDefinition& definition) const;
+};
+
+// Behavior trees written as types, for trees that are fixed at compile time:
+//   using SkeletonTree = bt::Selector<Patrol, bt::Sequence<ChasePlayer, AttackPlayer>>;
+//   cursor = bt::Tree<SkeletonTree>::tick(cursor, status);
+// Every node's pre-order index and parent are template arguments, so the whole tick (resume dispatch included) is
+// instantiated as direct calls the compiler can inline into one function per tree. Leaves are any class with a
+// static TYPE and static NodeState tick(AIStatus*). Indices, node states and the resume cursor are the same as in
+// the BehaviorTree built from the same shape, so entities can move between the two paths between ticks.
+namespace bt {
+	template <typename... Children> struct Selector {};
+	template <typename... Children> struct Sequence {};
+
+	// Ops<T>: the size of T's subtree, ticking T at a given position, and resuming somewhere inside T's subtree
+	template <typename T>
+	struct Ops {
+		static const int size = 1;
+
+		template <int Index, int Parent>
+		static int tick(AIStatus* status) {
+			AI_PROFILE_COUNT(nodesVisited, 1);
+			NodeState state = T::tick(status);
+			status->behavior->nodeStates[Index] = state;
+			return state == NodeState::Running ? Index : Parent;
+		}
+
+		template <int Index, int Parent>
+		static int resume(int, AIStatus* status) {return tick<Index, Parent>(status);}
+
+		static void flatten(TreeDefinition& out) {out.push_back({ (uint8_t)T::TYPE, 0 });}
+	};
+
+	template <typename... Children> struct SubtreeSize {static const int size = 0;};
+	template <typename Child, typename... Rest>
+	struct SubtreeSize<Child, Rest...> {static const int size = Ops<Child>::size + SubtreeSize<Rest...>::size;};
+
+	// Walks a composite's children in order. Selectors stop on the first True child and Sequences on the first False one,
+	// a Running child stops either and becomes the resume point - the same rules as Selector::run and Sequence::run.
+	template <NodeState Stop, int Index, int Parent, int ChildIndex, typename... Children>
+	struct CompositeChildren {
+		static int tick(AIStatus* status) {
+			status->behavior->nodeStates[Index] = Stop == NodeState::True ? NodeState::False : NodeState::True;
+			return Parent;
+		}
+		static int resume(int, AIStatus*) {return Index;}
+		static void flatten(TreeDefinition&) {}
+	};
+
+	template <NodeState Stop, int Index, int Parent, int ChildIndex, typename Child, typename... Rest>
+	struct CompositeChildren<Stop, Index, Parent, ChildIndex, Child, Rest...> {
+		using Next = CompositeChildren<Stop, Index, Parent, ChildIndex + Ops<Child>::size, Rest...>;
+
+		static int tick(AIStatus* status) {
+			NodeState* states = status->behavior->nodeStates;
+			int childNext = Ops<Child>::template tick<ChildIndex, Index>(status);
+			if (states[ChildIndex] == Stop) {
+				states[Index] = Stop;
+				return Parent;
+			}
+			if (states[ChildIndex] == NodeState::Running) {
+				states[Index] = NodeState::Running;
+				return childNext;
+			}
+			return Next::tick(status);
+		}
+
+		// the cursor is somewhere below this composite - find the child whose subtree holds it
+		static int resume(int cursor, AIStatus* status) {
+			if (cursor < ChildIndex + Ops<Child>::size) return Ops<Child>::template resume<ChildIndex, Index>(cursor, status);
+			return Next::resume(cursor, status);
+		}
+
+		static void flatten(TreeDefinition& out) {
+			Ops<Child>::flatten(out);
+			Next::flatten(out);
+		}
+	};
+
+	template <NodeType Type, NodeState Stop, typename... Children>
+	struct CompositeOps {
+		static const int size = 1 + SubtreeSize<Children...>::size;
+
+		template <int Index, int Parent>
+		static int tick(AIStatus* status) {
+			AI_PROFILE_COUNT(nodesVisited, 1);
+			return CompositeChildren<Stop, Index, Parent, Index + 1, Children...>::tick(status);
+		}
+
+		template <int Index, int Parent>
+		static int resume(int cursor, AIStatus* status) {
+			if (cursor == Index) return tick<Index, Parent>(status);
+			return CompositeChildren<Stop, Index, Parent, Index + 1, Children...>::resume(cursor, status);
+		}
+
+		static void flatten(TreeDefinition& out) {
+			out.push_back({ (uint8_t)Type, (uint8_t)sizeof...(Children) });
+			CompositeChildren<Stop, 0, 0, 1, Children...>::flatten(out);
+		}
+	};
+
+	template <typename... Children>
+	struct Ops<Selector<Children...>> : CompositeOps<NodeType::Selector, NodeState::True, Children...> {};
+	template <typename... Children>
+	struct Ops<Sequence<Children...>> : CompositeOps<NodeType::Sequence, NodeState::False, Children...> {};
+
+	template <typename Root>
+	struct Tree {
+		static const int size = Ops<Root>::size;
+		static_assert(size <= MAX_BEHAVIOR_NODES, "behavior tree has more nodes than BehaviorState can hold");
+
+		// same contract as CompiledTree::tick, the root is its own parent
+		static int tick(int nodeIndex, AIStatus* status) {
+			assert(nodeIndex >= 0 && nodeIndex < size);
+			return Ops<Root>::template resume<0, 0>(nodeIndex, status);
+		}
+
+		// the tree's shape, to check a loaded tree against
+		static TreeDefinition definition() {
+			TreeDefinition out;
+			Ops<Root>::flatten(out);
+			return out;
+		}
+	};
+}
+
+// The built-in trees as types, used for any loaded tree with the same shape - the shipped timed trees and the
+// untimed ones they replaced
+using SkeletonTreeType = bt::Selector<TimedPatrol, bt::Sequence<ChasePlayer, TimedAttackPlayer>>;
+using GoblinTreeType = bt::Selector<TimedPatrol, bt::Sequence<TimedStalkPlayer, bt::Sequence<ChasePlayer, TimedAttackPlayer>>>;
+using UntimedSkeletonTreeType = bt::Selector<Patrol, bt::Sequence<ChasePlayer, AttackPlayer>>;
+using UntimedGoblinTreeType = bt::Selector<Patrol, bt::Sequence<StalkPlayer, bt::Sequence<ChasePlayer, AttackPlayer>>>;
+
+// An immutable tree definition shared by every entity of an AI type.
+// nodes holds the tree in pre-order, so nodes[i]->index == i and BehaviorState::currentNode indexes straight into it.
+// The nodes themselves live in (and are freed with) the tree's arena.
+struct BehaviorTree {
+	TreeArena arena;
+	Node* root = nullptr;
+	std::vector<Node*> nodes;
+	CompiledTree compiled;
+	// set when a bt::Tree of the same shape exists, see AISystem::useStaticTrees
+	int (*staticTick)(int nodeIndex, AIStatus* status) = nullptr;
+
+	void setRoot(Node* newRoot) {
+		root = newRoot;
+		nodes.clear();
+		indexNode(root);
+		assert(nodes.size() <= MAX_BEHAVIOR_NODES);
+		compiled.compile(nodes);
+	}
+
+	// builds the nodes for a loaded definition into the arena, then indexes and compiles them like setRoot
+	void build(const TreeDefinition& definition);
+
+private:
+	void indexNode(Node* node) {
+		node->index = (int)nodes.size();
+		nodes.push_back(node);
+		if (CompositeNode* composite = dynamic_cast<CompositeNode*>(node)) {
+			for (Node* child : composite->getChildren()) indexNode(child);
+		}
+	}
+};
+
+// Dense copy of what the AI reads for every agent, in parallel arrays grouped by AIType, so each pass in Step streams
+// through them in order instead of looking fields up in the registry one at a time. Each agent's tree and LOD state
+// live here as well. Membership follows registry.hasAIs: spawns and deaths are reported through AISystem::OnAIAdded and
+// OnAIRemoved, and Sync rebuilds from the registry if it finds the two out of step, so a missed notification costs a
+// rebuild. The fields cached from HasAI and Enemy are read again by Sync every frame, so an edit shows up on the next
+// frame whether or not OnAIChanged was called - OnAIChanged only makes it show up straight away.
+struct AIWorkingSet {
+	std::vector<Entity> entities;
+	std::vector<AIType> type;
+	std::vector<float> detectionRadius, attackRadius, attackCooldown;  // cached from HasAI and Enemy
+	std::vector<BehaviorState> behavior;
+	std::vector<AILodState> lod;
+	// refreshed by Sync every frame - positions and velocities are the ones the frame started with, and the Motion
+	// pointers stay valid until something inserts into registry.motions (HandleEnemyAttacks)
+	std::vector<Motion*> motion;
+	std::vector<float> px, py, vx, vy, speed;
+	// agents whose type changed since AISystem last looked, and the task slots their old tree was running - AISystem
+	// releases the tasks, wakes the agents and clears both
+	std::vector<Entity> retyped;
+	std::vector<int32_t> droppedTasks;
+
+	void Add(Entity entity);
+	void Remove(Entity entity);
+	// re-reads the cached HasAI/Enemy fields, and starts the agent's tree and LOD state over if its type changed
+	void Refresh(Entity entity);
+	// brings membership, order and the per-frame fields up to date, returns true if it had to rebuild from the registry
+	bool Sync();
+	void Clear();
+
+	size_t size() const {return entities.size();}
+	// -1 if the entity isn't in the set
+	int IndexOf(Entity entity) const;
+	// the agents of one type are [first, second), once synced
+	std::pair<uint32_t, uint32_t> TypeRange(AIType agentType) const;
+
+private:
+	std::unordered_map<unsigned int, uint32_t> indices;
+	uint64_t idSum = 0;
+	bool sorted = true;
+	std::vector<uint32_t> order;
+	void SortByType();
+	void Rebuild();
+	void ReadCachedFields(uint32_t index);
+};
+
+// Hostile (AI) entities near the player, sorted by distance. Built once per frame so questions like
+// "how many enemies are engaging the player" are a binary search instead of a scan over every AI entity.
+struct PlayerProximity {
+	std::vector<float> distancesSq;  // ascending
+	std::vector<Entity> entities;    // same order as distancesSq
+
+	// keeps agents within maxRadius of playerPos
+	void Build(const AIWorkingSet& agents, vec2 playerPos, float maxRadius);
+	int CountWithin(float radius) const;
+
+private:
+	std::vector<std::pair<float, uint32_t>> scratch;
+};
+
+// Everything the AI can go after this frame - every player, then AISystem::decoys - packed so choosing and chasing a
+// target never goes back to the registry. Targets are bucketed in a grid, so an agent only looks at the targets near it
+// and picking one costs about the same however many targets there are.
+struct AITargetTable {
+	std::vector<Entity> entities;
+	std::vector<float> px, py, vx, vy, speed;
+	std::vector<uint8_t> vulnerable;  // 0 while the target is dying
+	std::vector<int> engaging;        // AI entities within GOBLIN_ALLY_RADIUS of each target, see AISystem::UpdatePlayerProximity
+	// the first vulnerable player, else the first vulnerable decoy, else target 0 - -1 only when there are no targets.
+	// Agents with nothing near them go after this one, and the flow field and event wakeups follow it.
+	int primary = -1;
+
+	void Build(const std::vector<Entity>& decoys, float cellSize);
+	size_t size() const {return entities.size();}
+	bool empty() const {return entities.empty();}
+	vec2 position(int target) const {return vec2(px[target], py[target]);}
+	bool AnyVulnerable() const {return primary >= 0 && vulnerable[primary];}
+
+	// the nearest vulnerable target within radius of position, the primary target when there isn't one
+	int Select(vec2 position, float radius) const;
+	// fills engaging from every agent's position
+	void CountEngaging(const AIWorkingSet& agents, float radius);
+
+private:
+	SpatialGrid grid;
+};
+
+// Wall-clock time spent in each part of Step, accumulated over frames while AISystem::collectTimings is set
+struct AIStepTimings {
+	int64_t senseNs = 0;   // syncing the agents, targets, wakeups, scheduling and perception
+	int64_t treeNs = 0;    // ticking the trees
+	int64_t boidNs = 0;    // bat movement
+	int64_t attackNs = 0;  // HandleEnemyAttacks
+	uint64_t frames = 0;
 };
 
 class AISystem {
 private:
-    Entity playerEntity;
-    Node* skeletonCurrentNode;
-    Node* goblinCurrentNode;
-    Node* mushroomCurrentNode;
-    std::default_random_engine rng;
-    std::uniform_real_distribution<float> uniformDist; // number between 0..1
+    // players and decoys, rebuilt at the start of every Step
+    AITargetTable targets;
+    // every tree the system owns - AI types with identical trees point at the same one
+    std::vector<std::unique_ptr<BehaviorTree>> trees;
+    BehaviorTree* skeletonTree = nullptr;
+    BehaviorTree* goblinTree = nullptr;
+    BehaviorTree* mushroomTree = nullptr;
+    void LoadBehaviorTrees();
+    void AttachStaticTrees();
+    // releases the tasks and wakes the agents in agents.retyped/droppedTasks
+    void DropRetypedState();
+    // every AI entity's hot fields, tree cursor and LOD state - synced with the registry at the start of RunAI
+    AIWorkingSet agents;
+    // rolls for random behaviors, keyed by entity id and frameIndex
+    AIRandom random;
+    uint32_t frameIndex = 0;
+    uint32_t RandomKey(Entity entity);
+
+    // Level of detail - the agents (indices into agents) ticked this frame, picked by ScheduleAI
+    std::vector<uint32_t> tickAgents;
+    std::vector<uint32_t> deferredAgents;
+    // running average of one agent's tree tick, used to turn lodBudgetMs into a number of agents
+    double lodAgentNs = 0;
+    void ScheduleAI(float elapsedMs);
+    // Each running agent's view of its target this frame, indexed like agents. UpdatePerception works each
+    // agent-to-target relation out once, and the trees (through SetTickTarget) and both boid updates only read it.
+    // Only the entries of this frame's agents list are filled in - the others are stale and nothing reads them.
+    struct Perception {
+        enum : uint8_t { Visible = 1, Detected = 2, Attackable = 4 };
+        std::vector<uint32_t> agents;  // the agents filled in this frame
+        std::vector<float> px, py, gatherDistSq, gatherInvDist;  // scratch, in agents order
+        std::vector<int> target;
+        std::vector<float> tx, ty, distSq, invDist;
+        std::vector<float> dirX, dirY;  // unit vector towards the target
+        std::vector<uint8_t> flags;
+        std::vector<StalkBand> band;
+    };
+    Perception perception;
+    void UpdatePerception();
+    // copies a ticked agent's target and distances out of perception into the status
+    void SetTickTarget(size_t tickIndex, AIStatus* status);
+
+    // Event wakeups - sleeping agents are left out of tickAgents until a wake condition fires, so the tree phase
+    // only sees agents that are awake. awakeEntities is every AI entity that isn't in sleepingAgents.
+    using WakeQueue = std::priority_queue<AIWakeEntry, std::vector<AIWakeEntry>, std::greater<AIWakeEntry>>;
+    ComponentContainer<AISleep> sleepingAgents;
+    std::vector<Entity> awakeEntities;
+    WakeQueue wakeOnFrame;   // Patrol: the next frame whose roll does something
+    WakeQueue wakeOnTime;    // Patrol: the earliest time the player could be within detection range
+    WakeQueue wakeOnTravel;  // Stalk: how far the player can travel before the agent could be out of its band
+    std::vector<AIWakeEntry> stalkSleepers;  // all woken when the number of enemies engaging the player changes
+    uint32_t sleepGeneration = 0;
+    // AI entity count and id sum the last time awakeEntities was rebuilt - ids are never reused, so any spawn or death changes them
+    size_t trackedAICount = 0;
+    uint64_t trackedAIIdSum = 0;
+    bool wakeupsStarted = false;
+    // the AI clock, advanced by every RunAI - wake times and timed leaves are measured against it
+    double aiTimeMs = 0;
+    double playerTravel = 0;
+    vec2 lastPlayerPos = { 0, 0 };
+    float wakePlayerSpeed = 0;  // fastest the player has moved, sleeping patrollers assume it can't go faster
+    int lastEnemiesEngaging = 0;
+    void UpdateWakeups(float elapsedMs);
+    void SleepIdleAgents();
+    void ClearWakeups();
+    bool IsAsleep(const AIWakeEntry& entry);
+    void WakeEntity(Entity entity);
+
+    // Record/replay - see StartRecording and Replay
+    AIRecorder recorder;
+    AIFrameRecord recordFrame;
+    // entity -> id it had when recorded, only filled while replaying
+    std::unordered_map<unsigned int, uint32_t> replayIds;
+    void RunAI(float elapsedMs);
+    void CaptureFrame(float elapsedMs, AIFrameRecord& frame);
+    void RestoreFrame(const AIFrameRecord& frame);
+    uint64_t ComputeFrameHash();
+
+    // Bats bucketed by position, rebuilt once per Step so boid rules only look at nearby cells
+    SpatialGrid boidGrid;
+    std::vector<Entity> boidEntities;
+    std::vector<Motion*> boidMotions;
+    std::vector<uint32_t> boidAgents;  // index into agents
+    void BuildBoidGrid();
+    bool ShouldConsiderForGrouping(uint32_t otherBoid, Entity entity, Motion& entityMotion);
+    bool ShouldSeparateFrom(uint32_t otherBoid, Entity entity, Motion& entityMotion);
+
+    // Packed copy of every bat's motion for the fused boid update, stored in boidGrid slot order
+    // so each neighbour row is a contiguous run of floats
+    struct BoidSoA {
+        std::vector<float> px, py, vx, vy, speed;
+        std::vector<float> chaseX, chaseY;  // unit vector towards the target, (0, 0) when the bat hasn't detected it
+        std::vector<vec2> newVelocity;
+        std::vector<uint32_t> boid; // slot -> index into boidEntities/boidMotions
+        void resize(size_t n);
+    };
+    BoidSoA boidSoA;
+    void MoveBoidsFused();
+
+    // Bats grouped into flocks for flockBoids: boidGrid cells with enough bats are joined with their dense neighbours by
+    // union-find, up to FLOCK_MAX_CELLS cells across, and each flock keeps the sums of its bats' positions and velocities.
+    struct BoidFlocks {
+        std::vector<uint64_t> cellKey;  // occupied cells in key order
+        std::vector<uint32_t> cellStart, cellCount;  // slot range of each cell
+        std::vector<int> parent;        // union-find over cells
+        std::vector<int> minX, maxX, minY, maxY;  // cell bounds, per root
+        std::vector<float> count, sumPx, sumPy, sumVx, sumVy;  // per root
+        std::vector<int> flockOfSlot;   // root cell of the bat's flock, -1 for bats left to the exact neighbour loop
+        int Find(int cell);
+        void Union(int a, int b);
+    };
+    BoidFlocks boidFlocks;
+    void BuildBoidFlocks();
+
+    // Per-frame helpers
+    void InitializeStatus();
+    void PruneAttackStates();
+    BehaviorTree* GetBehaviorTree(AIType type);
+    // tickIndex is the agent's position in tickAgents
+    void ProcessAI(size_t tickIndex, AIStatus* status);
+    void UpdateAIStatus(uint32_t agent, AIStatus* status);
+    void UpdateGoblinBehavior(AIStatus* status);
+
+    PlayerProximity playerProximity;
+    int enemiesEngagingPlayer = 0;  // AI entities within GOBLIN_ALLY_RADIUS of the primary target this frame
+    void UpdatePlayerProximity();
+    void GenerateRandomNumbers(AIStatus* status);
+
+    // Parallel tree ticking - see parallelAI
+    std::unique_ptr<AIJobPool> jobPool;
+    std::vector<AIStatus> workerStatuses;
+    void ProcessAIParallel();
+
+    // Agents resuming at the same kind of leaf, packed so the leaf can run as one loop over plain arrays - see batchedLeafTicks
+    struct LeafBatch {
+        std::vector<BehaviorState*> behavior;
+        std::vector<Motion*> motion;
+        std::vector<uint32_t> id;
+        std::vector<uint16_t> node, parent;
+        std::vector<float> vx, vy, speed;
+        std::vector<float> dirX, dirY;    // unit vector towards the target
+        std::vector<float> flowX, flowY;  // flow field direction, (0, 0) to go straight at the target
+        std::vector<uint8_t> nearby, attackable, shouldAttack;
+        std::vector<StalkBand> band;
+        std::vector<int> rand, rand2;
+        std::vector<NodeState> result;
+        void clear();
+        void push(AIStatus& status, BehaviorState& state, uint32_t randomKey, int nodeIndex, const CompiledNode& node);
+    };
+    LeafBatch patrolBatch;
+    LeafBatch chaseBatch;
+    LeafBatch stalkBatch;
+    LeafBatch* GetLeafBatch(NodeType type);
+    static void TickPatrolBatch(LeafBatch& batch);
+    static void TickChaseBatch(LeafBatch& batch);
+    static void TickStalkBatch(LeafBatch& batch);
+    void ProcessAIBatched();
+    void ApplyLeafBatch(LeafBatch& batch);
+    void UpdateEntityMovement(uint32_t agent);
+
+    // attack cycles of the enemies that aren't idle, see EnemyAttackState
+    ComponentContainer<EnemyAttackState> attackStates;
+    bool AdvanceAttackState(Entity entity, EnemyAttackState& state, bool wantsAttack, RenderSystem* renderer);
+    Entity AttackTargetOf(uint32_t agent) const;
+    void SetAttackPhase(EnemyAttackState& state, EnemyAttackState::Phase phase);
 
     // Helper functions for behavior tree construction
-    Node* CreateSkeletonBehaviorTree();
-    Node* CreateGoblinBehaviorTree();
-    Node* CreateMushroomBehaviorTree();
-    Selector* CreateRootNode();
-    Patrol* CreatePatrolNode(Node* parent);
-    Sequence* CreateChaseSequenceNode(Node* parent, std::initializer_list<Node*> children);
-    Sequence* CreateSequenceNode(Node* parent);
-    StalkPlayer* CreateStalkPlayerNode(Node* parent);
+    // (nodes are allocated from the arena of the tree being built)
+    Node* CreateSkeletonBehaviorTree(TreeArena& arena);
+    Node* CreateGoblinBehaviorTree(TreeArena& arena);
+    Node* CreateMushroomBehaviorTree(TreeArena& arena);
+    Selector* CreateRootNode(TreeArena& arena);
+    TimedPatrol* CreatePatrolNode(TreeArena& arena, Node* parent);
+    Sequence* CreateChaseSequenceNode(TreeArena& arena, Node* parent);
+    Sequence* CreateSequenceNode(TreeArena& arena, Node* parent);
+    TimedStalkPlayer* CreateStalkPlayerNode(TreeArena& arena, Node* parent);
+
+    AIStatus mainStatus;
+#ifdef AI_COROUTINES
+    // frames of the coroutines timed leaves are running, see AITask
+    AITaskPool taskPool;
+#endif
+
+    // the level's walls, filled in by LoadLevel - empty until a level is loaded
+    NavGrid navGrid;
+    // distance field to the primary target's tile, rebuilt when it changes tiles - see useFlowField
+    FlowField playerFlowField;
+    // tiles that can see the primary target's tile, rebuilt when it changes tiles - see lineOfSight
+    VisibilityGrid playerVisibility;
+    // signed distance to the walls in navGrid, built by LoadLevel and SetWallTile
+    WallDistanceField wallField;
 
 public:
-    // One ai status for all entities - continually updated
-    AIStatus* status;
+    // One ai status for all entities - continually updated (worker threads get their own)
+    AIStatus* status = &mainStatus;
+
+    // When set, bats are updated in one fused neighbour pass over a per-frame snapshot instead of MoveBoid per bat.
+    // Every bat then reads its neighbours' velocities from the start of the frame rather than partially updated ones.
+    bool fusedBoidUpdate = false;
+
+    // Bats in dense, compact flocks (see BoidFlocks) take their cohesion and alignment from the flock's sums instead of
+    // summing every neighbour in BOID_GROUPING_RADIUS, so only the short separation query still loops over neighbours.
+    // Bats in sparse or sprawling groups keep the exact rules. Uses the fused update whether or not fusedBoidUpdate is set.
+    bool flockBoids = false;
+
+    // When set, ProcessAI runs over chunks of AI entities on a thread pool. Each worker ticks with its own AIStatus and
+    // trees only write their own entity's state, so the result matches the serial update.
+    bool parallelAI = false;
+
+    // Tick the flattened CompiledTree copies instead of the Node objects. Both give the same result.
+    bool useCompiledTrees = true;
+
+    // Tick trees whose shape matches one of the bt:: tree types through that type's inlined tick. Trees with any
+    // other shape (modded data files) keep using useCompiledTrees or the Node objects.
+    bool useStaticTrees = true;
+
+    // Group agents by the leaf they resume at and run Patrol/ChasePlayer/StalkPlayer once per batch over packed arrays.
+    // Agents sitting on a composite or AttackPlayer are ticked normally. Takes precedence over parallelAI.
+    bool batchedLeafTicks = false;
+
+    // Tick agents far from the player less often. Agents within LOD_NEAR_RATIO detection radii of the player tick every
+    // frame, the rest every LOD_MID_INTERVAL or LOD_FAR_INTERVAL frames in buckets staggered by entity, and their skipped
+    // time is handed to the next tick as AIStatus::elapsedMs. Bats far away keep their last velocity in between.
+    bool levelOfDetail = false;
+    // With levelOfDetail, the most tree time to spend on the distant agents that are due in one frame (0 = no limit).
+    // Agents over the budget are ticked first on the following frames, so a big spawn is spread out instead of spiking.
+    // Ignored while recording or replaying, since it depends on timing.
+    float lodBudgetMs = 0;
+
+    // Put agents to sleep while they wait in Patrol (until the player could come into range or a roll makes them act)
+    // or hold their distance in the StalkPlayer band (until the player moves or another enemy engages), instead of
+    // re-evaluating their trees every frame. Sleeping ticks would not have changed anything apart from which way a
+    // holding stalker faces, which UpdateWakeups keeps up to date, so the result is the same.
+    // The wake conditions assume a single target, so everyone stays awake while there are decoys or co-op players.
+    bool eventWakeups = false;
+
+    // Chasing and approaching enemies follow playerFlowField around the level's walls (see LoadLevel) instead of
+    // steering straight at the player. Only agents after the primary target use it, the others steer straight at theirs.
+    bool useFlowField = false;
+
+    // When set, walls in the level block sight: an agent only detects or attacks a target it can see. Agents after the
+    // primary target look it up in a visibility grid, the others trace their own line.
+    bool lineOfSight = false;
+
+    // Entities other than the players that enemies will go after (lures, summoned allies). Each needs a Motion, and is
+    // skipped while it has none or is dying. Every agent goes after the nearest vulnerable target in its detection
+    // radius, or the primary target (normally the first player) when there is none.
+    std::vector<Entity> decoys;
+
+    // Measure how long each part of Step takes, into timings
+    bool collectTimings = false;
+    AIStepTimings timings;
 
     AISystem();
+    // Patrol rolls are a function of this seed, the entity and the frame - set it to make AI behavior reproducible
+    void SetRandomSeed(uint64_t seed);
+
+    // Writes the seed and every Step's AI inputs (players, decoys, AI entities, elapsedMs) plus a hash of the results to path
+    bool StartRecording(const std::string& path);
+    void StopRecording();
+    // Headless only: clears the registry, then re-runs every recorded frame and compares the result hashes
+    AIReplayResult Replay(const std::string& path);
+    // renderer can be nullptr when there is no window (benchmarks, tools) - attacks then go through their whole cycle
+    // without spawning the attack entity
     void Step(float elapsedMs, RenderSystem* renderer);
+    // Keep the AI's copy of the agents in step with the registry: call after giving an entity HasAI, before removing it
+    // (or the entity), and after changing its HasAI or Enemy fields. A missed add or remove is caught up by a full rebuild,
+    // a missed change by the next frame's Sync.
+    void OnAIAdded(Entity entity);
+    void OnAIRemoved(Entity entity);
+    void OnAIChanged(Entity entity);
+    // Puts a sleeping agent back on the tick list - for anything outside the AI that moves it or changes what it should do
+    void WakeAgent(Entity entity);
+    // Call when a level loads: walls holds one entry per tile, row by row, non-zero for a wall. The flow field, line of
+    // sight and bat wall avoidance all work from it - until a level is loaded enemies steer straight at their target and
+    // see everything. Bats keep off the window edges instead while there is no level or the level has no walls.
+    void LoadLevel(int width, int height, float tileSize, vec2 origin, const std::vector<uint8_t>& walls);
+    // A tile turning into a wall or opening up after the level loaded (a door, a destroyed wall)
+    void SetWallTile(int x, int y, bool wall);
+    const NavGrid& getNavGrid() const {return navGrid;}
     void HandleEnemyAttacks(RenderSystem* renderer);
-    void AttackPlayer(Entity damagingEnemy, float damage, RenderSystem* renderer);
+    void LaunchEnemyAttack(Entity damagingEnemy, Entity target, float damage, RenderSystem* renderer);
     bool IsNearby(Motion& motion1, Motion& motion2, float nearbyRadius);
-    void MoveBoid(Entity& entity);
+    void MoveBoid(uint32_t agent);
     vec2 GroupBoid(Entity& entity);
     vec2 SeparateBoid(Entity& entity);
     vec2 MatchVelocityBoid(Entity& entity);
-    vec2 ChasePlayerBoid(Entity& entity);
+    vec2 ChasePlayerBoid(uint32_t agent);
     void AvoidWallsBoid(Entity& entity);
 };
@@ -0,0 +1,105 @@
+// internal
+#include "ai_task.hpp"
+
+#ifdef AI_COROUTINES
+
+static void SuspendUntil(AITask::Handle handle, double resumeAtMs) {
+	AITask::promise_type& promise = handle.promise();
+	promise.wait = AITask::Wait::Time;
+	promise.resumeAtMs = resumeAtMs;
+	if (promise.pool) promise.pool->ScheduleWake(promise.slot, resumeAtMs);
+}
+
+void WaitFor::await_suspend(AITask::Handle suspended) noexcept {
+	handle = suspended;
+	SuspendUntil(handle, handle.promise().nowMs + ms);
+}
+
+void ResumeAt::await_suspend(AITask::Handle suspended) noexcept {
+	handle = suspended;
+	SuspendUntil(handle, timeMs);
+}
+
+AITask* AITaskPool::Start(int32_t& slot, AITask (*body)(AITaskFrame)) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (freeSlots.empty()) {
+			if (chunkCount == MAX_CHUNKS) {
+				slot = -1;
+				return nullptr;
+			}
+			chunks[chunkCount].reset(new Slot[CHUNK_SLOTS]);
+			// handed out lowest first
+			for (int i = CHUNK_SLOTS - 1; i >= 0; i--) {
+				freeSlots.push_back(chunkCount * CHUNK_SLOTS + i);
+			}
+			chunkCount++;
+		}
+		slot = freeSlots.back();
+		freeSlots.pop_back();
+		inUse++;
+	}
+
+	// the slot is this caller's now, so the coroutine is made outside the lock
+	Slot& storage = SlotAt(slot);
+	storage.task = body(AITaskFrame{ storage.frame });
+	storage.generation++;
+	AITask::promise_type& promise = storage.task.handle.promise();
+	promise.pool = this;
+	promise.slot = slot;
+	return &storage.task;
+}
+
+void AITaskPool::Release(int32_t& slot) {
+	if (slot < 0) return;
+	SlotAt(slot).task.reset();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		freeSlots.push_back(slot);
+		inUse--;
+	}
+	slot = -1;
+}
+
+void AITaskPool::ReleaseUnowned(const std::vector<int32_t>& owners) {
+	std::vector<uint8_t> owned((size_t)chunkCount * CHUNK_SLOTS, 0);
+	for (int32_t slot : owners) {
+		if (slot >= 0) owned[slot] = 1;
+	}
+	for (int32_t slot = 0; slot < chunkCount * CHUNK_SLOTS; slot++) {
+		if (!owned[slot] && SlotAt(slot).task) {
+			int32_t released = slot;
+			Release(released);
+		}
+	}
+}
+
+void AITaskPool::Clear() {
+	std::lock_guard<std::mutex> lock(mutex);
+	for (int chunk = 0; chunk < chunkCount; chunk++) {
+		chunks[chunk].reset();
+	}
+	chunkCount = 0;
+	freeSlots.clear();
+	inUse = 0;
+	timers = {};
+}
+
+void AITaskPool::ScheduleWake(int32_t slot, double resumeAtMs) {
+	std::lock_guard<std::mutex> lock(mutex);
+	timers.push({ resumeAtMs, slot, SlotAt(slot).generation });
+}
+
+void AITaskPool::WakeDue(double nowMs) {
+	while (!timers.empty() && timers.top().resumeAtMs <= nowMs) {
+		Timer timer = timers.top();
+		timers.pop();
+		Slot& storage = SlotAt(timer.slot);
+		// the task in the slot now is the one that set the timer, and it's still waiting for it
+		if (storage.generation != timer.generation || !storage.task) continue;
+		AITask::promise_type& promise = storage.task.handle.promise();
+		if (promise.wait == AITask::Wait::Time && promise.resumeAtMs <= nowMs) promise.due = true;
+	}
+}
+
+#endif
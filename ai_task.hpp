@@ -0,0 +1,227 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+// Long-running leaf behaviors written as C++20 coroutines, for leaves that wait (pauses, windups, cooldowns) instead of
+// deciding everything again every tick. A task runs until it co_awaits one of
+//   WaitFor(ms)       - resumes once the AI clock (AISystem::aiTimeMs) has moved on by ms
+//   ResumeAt(timeMs)  - resumes once the AI clock reaches timeMs
+//   NextFrame()       - resumes on the agent's next tick
+//   WaitUntil(check)  - resumes on the first tick check(status) is true
+//   ThisTick()        - doesn't suspend, just hands back the status (for the first line of a task)
+// and every co_await gives back the AIStatus of the tick it resumed in. Timed waits go into AITaskPool's timer queue,
+// which AISystem pops once a frame (WakeDue) to mark the tasks whose time has come - Ready() reads that mark instead
+// of checking the clock, and the queue is only popped as far as the timers that fired.
+// Builds without coroutine support leave AI_COROUTINES undefined and the coroutine leaves fall back to plain ones.
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#define AI_COROUTINES 1
+#endif
+
+#ifdef AI_COROUTINES
+
+struct AIStatus;
+class AITaskPool;
+
+// Where a task's coroutine frame goes - every task body takes one as its first parameter, which is how its promise's
+// operator new finds the agent's slot in the AITaskPool. A body without one doesn't compile.
+struct AITaskFrame {
+	static const size_t SIZE = 512;
+	void* memory;
+};
+
+class AITask {
+public:
+	struct promise_type;
+	using Handle = std::coroutine_handle<promise_type>;
+	enum class Wait : uint8_t { None, Time, Frame, Condition };
+
+	struct promise_type {
+		AIStatus* status = nullptr;
+		double nowMs = 0;
+		Wait wait = Wait::None;
+		double resumeAtMs = 0;
+		bool (*condition)(const AIStatus*) = nullptr;
+		// set by AITaskPool::WakeDue once a timed wait is over
+		bool due = false;
+		// where the task runs, for the timer queue
+		AITaskPool* pool = nullptr;
+		int32_t slot = -1;
+
+		AITask get_return_object() {return AITask(Handle::from_promise(*this));}
+		// nothing runs until the first Resume, so a task is created and started in separate steps
+		std::suspend_always initial_suspend() noexcept {return {};}
+		std::suspend_always final_suspend() noexcept {return {};}
+		void return_void() {}
+		void unhandled_exception() {std::terminate();}
+
+		// frames too big for a slot go to the heap, operator delete gets the same size and makes the same choice
+		template <typename... Args>
+		static void* operator new(size_t size, const AITaskFrame& frame, const Args&...) {
+			return size <= AITaskFrame::SIZE ? frame.memory : ::operator new(size);
+		}
+		static void operator delete(void* memory, size_t size) {
+			if (size > AITaskFrame::SIZE) ::operator delete(memory);
+		}
+	};
+
+	AITask() = default;
+	AITask(AITask&& other) noexcept : handle(other.handle) {other.handle = nullptr;}
+	AITask& operator=(AITask&& other) noexcept {
+		if (this != &other) {
+			reset();
+			handle = other.handle;
+			other.handle = nullptr;
+		}
+		return *this;
+	}
+	AITask(const AITask&) = delete;
+	AITask& operator=(const AITask&) = delete;
+	~AITask() {reset();}
+
+	explicit operator bool() const {return (bool)handle;}
+	bool done() const {return handle.done();}
+
+	// whether what the task waits for has come - a timed wait is over once the timer queue has marked it due
+	bool Ready(const AIStatus* status) const {
+		const promise_type& promise = handle.promise();
+		switch (promise.wait) {
+		case Wait::Time:      return promise.due;
+		case Wait::Condition: return promise.condition(status);
+		default:              return true;
+		}
+	}
+
+	// the AI clock time a WaitFor is over, false if the task is waiting on something else
+	bool WaitingUntil(double& resumeAtMs) const {
+		if (handle.promise().wait != Wait::Time) return false;
+		resumeAtMs = handle.promise().resumeAtMs;
+		return true;
+	}
+
+	// runs the task up to its next co_await (or its end)
+	void Resume(AIStatus* status, double nowMs) {
+		promise_type& promise = handle.promise();
+		promise.status = status;
+		promise.nowMs = nowMs;
+		promise.wait = Wait::None;
+		promise.due = false;
+		handle.resume();
+	}
+
+	void reset() {
+		if (handle) handle.destroy();
+		handle = nullptr;
+	}
+
+private:
+	friend class AITaskPool;
+	explicit AITask(Handle handle) : handle(handle) {}
+	Handle handle = nullptr;
+};
+
+// Base of the awaitables: keeps the handle so the status of the resuming tick can be handed back
+struct AITaskAwaiter {
+	AITask::Handle handle = nullptr;
+	bool await_ready() const noexcept {return false;}
+	AIStatus* await_resume() const noexcept {return handle.promise().status;}
+};
+
+struct WaitFor : AITaskAwaiter {
+	float ms;
+	explicit WaitFor(float ms) : ms(ms) {}
+	void await_suspend(AITask::Handle suspended) noexcept;
+};
+
+// WaitFor with the end given on the AI clock, for tasks that keep their own deadlines (see BehaviorState::taskWakeMs)
+struct ResumeAt : AITaskAwaiter {
+	double timeMs;
+	explicit ResumeAt(double timeMs) : timeMs(timeMs) {}
+	void await_suspend(AITask::Handle suspended) noexcept;
+};
+
+struct NextFrame : AITaskAwaiter {
+	void await_suspend(AITask::Handle suspended) noexcept {
+		handle = suspended;
+		handle.promise().wait = AITask::Wait::Frame;
+	}
+};
+
+struct WaitUntil : AITaskAwaiter {
+	bool (*condition)(const AIStatus*);
+	explicit WaitUntil(bool (*condition)(const AIStatus*)) : condition(condition) {}
+	void await_suspend(AITask::Handle suspended) noexcept {
+		handle = suspended;
+		AITask::promise_type& promise = handle.promise();
+		promise.wait = AITask::Wait::Condition;
+		promise.condition = condition;
+	}
+};
+
+struct ThisTick : AITaskAwaiter {
+	// returning false carries on without suspending
+	bool await_suspend(AITask::Handle current) noexcept {
+		handle = current;
+		return false;
+	}
+};
+
+// Frame storage for every running AITask: one fixed-size slot per task, and an agent runs at most one task at a time,
+// so this is a slot per agent in a timed leaf. Slots sit in chunks that never move, and handing them out or taking
+// them back is done under a lock, so trees ticking on several threads can start and finish tasks.
+// Agents keep their slot index in BehaviorState::task, -1 when they have none.
+// The pool also keeps the timer queue for WaitFor/ResumeAt: AISystem calls WakeDue once a frame, before the trees, so
+// timed waits end on the same frame whether the agent ticks every frame, on an LOD interval or sleeps until then.
+class AITaskPool {
+public:
+	static const int CHUNK_SLOTS = 256;
+	static const int MAX_CHUNKS = 1024;
+
+	// Starts body in a new slot and stores the slot in slot, nullptr (and -1) if every slot is taken
+	AITask* Start(int32_t& slot, AITask (*body)(AITaskFrame));
+	// nullptr for -1
+	AITask* Get(int32_t slot) const {return slot < 0 ? nullptr : &SlotAt(slot).task;}
+	// ends the task (if any) and sets slot to -1
+	void Release(int32_t& slot);
+	// ends every task whose slot isn't in owners - for agents that left without AISystem::OnAIRemoved
+	void ReleaseUnowned(const std::vector<int32_t>& owners);
+	void Clear();
+
+	// queues a wake for the task in slot, called by WaitFor and ResumeAt as the task suspends
+	void ScheduleWake(int32_t slot, double resumeAtMs);
+	// marks every task whose timed wait is over by nowMs as due
+	void WakeDue(double nowMs);
+
+	size_t size() const {return inUse;}
+
+private:
+	struct Slot {
+		alignas(std::max_align_t) unsigned char frame[AITaskFrame::SIZE];
+		AITask task;
+		// counts the tasks started in the slot, so timers left by an earlier task are ignored
+		uint32_t generation = 0;
+	};
+	struct Timer {
+		double resumeAtMs;
+		int32_t slot;
+		uint32_t generation;
+		bool operator>(const Timer& other) const {return resumeAtMs > other.resumeAtMs;}
+	};
+	Slot& SlotAt(int32_t slot) const {return chunks[slot / CHUNK_SLOTS][slot % CHUNK_SLOTS];}
+
+	std::unique_ptr<Slot[]> chunks[MAX_CHUNKS];
+	int chunkCount = 0;
+	std::vector<int32_t> freeSlots;
+	size_t inUse = 0;
+	std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+	std::mutex mutex;
+};
+
+#endif
@@ -0,0 +1,342 @@
+// internal
+#include "behavior_tree_loader.hpp"
+#include "ai_system.hpp"
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+const char TREE_BINARY_MAGIC[4] = { 'W', 'B', 'T', '1' };
+
+// names used in the text format, indexed by NodeType
+static const char* NODE_TYPE_NAMES[NODE_TYPE_COUNT] = { "Selector", "Sequence", "Patrol", "ChasePlayer", "AttackPlayer", "StalkPlayer", "TimedPatrol", "TimedStalkPlayer", "TimedAttackPlayer" };
+
+static int NodeTypeFromName(const std::string& name) {
+	for (int i = 0; i < NODE_TYPE_COUNT; i++) {
+		if (name == NODE_TYPE_NAMES[i]) return i;
+	}
+	return -1;
+}
+
+bool BehaviorTreeLibrary::Validate(const TreeDefinition& tree, std::string& error) {
+	if (tree.empty()) {
+		error = "tree is empty";
+		return false;
+	}
+	if (tree.size() > MAX_BEHAVIOR_NODES) {
+		error = "tree has more than " + std::to_string(MAX_BEHAVIOR_NODES) + " nodes";
+		return false;
+	}
+
+	// walk the pre-order list keeping track of how many nodes are still owed to open composites
+	int pending = 1;
+	for (const TreeNodeDef& node : tree) {
+		if (pending == 0) {
+			error = "nodes left over after the root's subtree ended";
+			return false;
+		}
+		pending--;
+		if (node.type >= NODE_TYPE_COUNT) {
+			error = "unknown node type " + std::to_string(node.type);
+			return false;
+		}
+		bool composite = IsCompositeType((NodeType)node.type);
+		if (composite && (node.childCount == 0 || node.childCount > CompositeNode::MAX_CHILDREN)) {
+			error = std::string(NODE_TYPE_NAMES[node.type]) + " needs between 1 and " + std::to_string(CompositeNode::MAX_CHILDREN) + " children";
+			return false;
+		}
+		if (!composite && node.childCount != 0) {
+			error = std::string(NODE_TYPE_NAMES[node.type]) + " is a leaf and can't have children";
+			return false;
+		}
+		pending += node.childCount;
+	}
+	if (pending != 0) {
+		error = "tree ends before all children were given";
+		return false;
+	}
+	return true;
+}
+
+void BehaviorTreeLibrary::AddTree(const std::string& name, const TreeDefinition& tree) {
+	for (int i = 0; i < (int)trees.size(); i++) {
+		const TreeDefinition& existing = trees[i];
+		if (existing.size() == tree.size() && memcmp(existing.data(), tree.data(), tree.size() * sizeof(TreeNodeDef)) == 0) {
+			names[name] = i;
+			return;
+		}
+	}
+	names[name] = (int)trees.size();
+	trees.push_back(tree);
+}
+
+const TreeDefinition* BehaviorTreeLibrary::Find(const std::string& name) const {
+	int index = FindIndex(name);
+	return index < 0 ? nullptr : &trees[index];
+}
+
+int BehaviorTreeLibrary::FindIndex(const std::string& name) const {
+	auto it = names.find(name);
+	return it == names.end() ? -1 : it->second;
+}
+
+// Text format
+
+namespace {
+	struct TreeParser {
+		const std::string& text;
+		const std::string& sourceName;
+		size_t pos = 0;
+		int line = 1;
+		std::string error;
+		// def name -> flattened subtree
+		std::unordered_map<std::string, TreeDefinition> defs;
+
+		TreeParser(const std::string& text, const std::string& sourceName) : text(text), sourceName(sourceName) {}
+
+		void SkipSpace() {
+			while (pos < text.size()) {
+				char c = text[pos];
+				if (c == '#') {
+					while (pos < text.size() && text[pos] != '\n') pos++;
+				} else if (isspace((unsigned char)c)) {
+					if (c == '\n') line++;
+					pos++;
+				} else {
+					break;
+				}
+			}
+		}
+
+		bool AtEnd() {
+			SkipSpace();
+			return pos >= text.size();
+		}
+
+		bool Fail(const std::string& message) {
+			if (error.empty()) error = sourceName + ":" + std::to_string(line) + ": " + message;
+			return false;
+		}
+
+		bool Expect(char c) {
+			SkipSpace();
+			if (pos < text.size() && text[pos] == c) {
+				pos++;
+				return true;
+			}
+			return Fail(std::string("expected '") + c + "'");
+		}
+
+		bool Peek(char c) {
+			SkipSpace();
+			return pos < text.size() && text[pos] == c;
+		}
+
+		bool Identifier(std::string& out) {
+			SkipSpace();
+			size_t start = pos;
+			while (pos < text.size() && (isalnum((unsigned char)text[pos]) || text[pos] == '_')) pos++;
+			if (start == pos) return Fail("expected a name");
+			out = text.substr(start, pos - start);
+			return true;
+		}
+
+		// NodeType [ '(' expr {',' expr} ')' ]  |  def name
+		bool Expression(TreeDefinition& out) {
+			std::string name;
+			if (!Identifier(name)) return false;
+
+			int type = NodeTypeFromName(name);
+			if (type < 0) {
+				auto def = defs.find(name);
+				if (def == defs.end()) return Fail("unknown node or subtree '" + name + "'");
+				out.insert(out.end(), def->second.begin(), def->second.end());
+				return true;
+			}
+
+			size_t self = out.size();
+			out.push_back({ (uint8_t)type, 0 });
+			if (!Peek('(')) return true;
+
+			Expect('(');
+			do {
+				if (!Expression(out)) return false;
+				out[self].childCount++;
+			} while (Peek(',') && Expect(','));
+			return Expect(')');
+		}
+
+		bool Parse(std::vector<std::pair<std::string, TreeDefinition>>& treesOut) {
+			while (!AtEnd()) {
+				std::string keyword, name;
+				if (!Identifier(keyword) || !Identifier(name) || !Expect('=')) return false;
+
+				TreeDefinition tree;
+				if (!Expression(tree)) return false;
+
+				std::string validationError;
+				if (!BehaviorTreeLibrary::Validate(tree, validationError)) return Fail(name + ": " + validationError);
+
+				if (keyword == "def") {
+					defs[name] = tree;
+				} else if (keyword == "tree") {
+					// a tree name can also be reused as a subtree
+					defs[name] = tree;
+					treesOut.push_back({ name, tree });
+				} else {
+					return Fail("expected 'def' or 'tree', got '" + keyword + "'");
+				}
+			}
+			return true;
+		}
+	};
+}
+
+bool BehaviorTreeLibrary::LoadText(const std::string& text, const std::string& sourceName) {
+	TreeParser parser(text, sourceName);
+	std::vector<std::pair<std::string, TreeDefinition>> parsed;
+	if (!parser.Parse(parsed)) {
+		printf("ERROR %s\n", parser.error.c_str());
+		return false;
+	}
+	// only commit once the whole file parsed, so a bad file doesn't leave half its trees behind
+	for (auto& entry : parsed) {
+		AddTree(entry.first, entry.second);
+	}
+	return true;
+}
+
+// Binary format (little endian):
+//   "WBT1" | u16 treeCount | u16 nameCount
+//   treeCount x { u16 nodeCount | nodeCount x { u8 type, u8 childCount } }
+//   nameCount x { u8 length | length chars | u16 tree index }
+
+bool BehaviorTreeLibrary::LoadBinary(const uint8_t* data, size_t size, const std::string& sourceName) {
+	size_t pos = 0;
+	auto readU16 = [&](uint16_t& value) {
+		if (pos + 2 > size) return false;
+		value = (uint16_t)(data[pos] | (data[pos + 1] << 8));
+		pos += 2;
+		return true;
+	};
+
+	uint16_t treeCount, nameCount;
+	if (size < sizeof(TREE_BINARY_MAGIC) || memcmp(data, TREE_BINARY_MAGIC, sizeof(TREE_BINARY_MAGIC)) != 0) {
+		printf("ERROR %s is not a behavior tree binary\n", sourceName.c_str());
+		return false;
+	}
+	pos = sizeof(TREE_BINARY_MAGIC);
+	if (!readU16(treeCount) || !readU16(nameCount)) {
+		printf("ERROR %s is truncated\n", sourceName.c_str());
+		return false;
+	}
+
+	std::vector<TreeDefinition> loaded(treeCount);
+	for (TreeDefinition& tree : loaded) {
+		uint16_t nodeCount;
+		if (!readU16(nodeCount) || pos + nodeCount * sizeof(TreeNodeDef) > size) {
+			printf("ERROR %s is truncated\n", sourceName.c_str());
+			return false;
+		}
+		// TreeNodeDef is two bytes, so the nodes copy straight out of the mapping
+		tree.resize(nodeCount);
+		memcpy(tree.data(), data + pos, nodeCount * sizeof(TreeNodeDef));
+		pos += nodeCount * sizeof(TreeNodeDef);
+
+		std::string error;
+		if (!Validate(tree, error)) {
+			printf("ERROR %s: %s\n", sourceName.c_str(), error.c_str());
+			return false;
+		}
+	}
+
+	std::vector<std::pair<std::string, int>> loadedNames;
+	for (int i = 0; i < nameCount; i++) {
+		if (pos >= size || pos + 1 + data[pos] > size) {
+			printf("ERROR %s is truncated\n", sourceName.c_str());
+			return false;
+		}
+		uint8_t length = data[pos++];
+		std::string name((const char*)data + pos, length);
+		pos += length;
+		uint16_t index;
+		if (!readU16(index) || index >= treeCount) {
+			printf("ERROR %s: tree '%s' points at a missing tree\n", sourceName.c_str(), name.c_str());
+			return false;
+		}
+		loadedNames.push_back({ name, index });
+	}
+
+	for (auto& entry : loadedNames) {
+		AddTree(entry.first, loaded[entry.second]);
+	}
+	return true;
+}
+
+bool BehaviorTreeLibrary::SaveBinary(const std::string& path) const {
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) {
+		printf("ERROR could not write %s\n", path.c_str());
+		return false;
+	}
+	auto writeU16 = [&](uint16_t value) {
+		char bytes[2] = { (char)(value & 0xff), (char)(value >> 8) };
+		out.write(bytes, 2);
+	};
+
+	out.write(TREE_BINARY_MAGIC, sizeof(TREE_BINARY_MAGIC));
+	writeU16((uint16_t)trees.size());
+	writeU16((uint16_t)names.size());
+	for (const TreeDefinition& tree : trees) {
+		writeU16((uint16_t)tree.size());
+		out.write((const char*)tree.data(), tree.size() * sizeof(TreeNodeDef));
+	}
+	for (auto& entry : names) {
+		out.put((char)std::min<size_t>(entry.first.size(), 255));
+		out.write(entry.first.data(), std::min<size_t>(entry.first.size(), 255));
+		writeU16((uint16_t)entry.second);
+	}
+	return true;
+}
+
+bool BehaviorTreeLibrary::LoadFile(const std::string& path) {
+#ifndef _WIN32
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	size_t size = (size_t)info.st_size;
+	void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) return false;
+
+	const uint8_t* data = (const uint8_t*)mapping;
+	bool ok = size >= sizeof(TREE_BINARY_MAGIC) && memcmp(data, TREE_BINARY_MAGIC, sizeof(TREE_BINARY_MAGIC)) == 0
+		? LoadBinary(data, size, path)
+		: LoadText(std::string((const char*)data, size), path);
+	munmap(mapping, size);
+	return ok;
+#else
+	std::ifstream in(path, std::ios::binary);
+	if (!in.is_open()) return false;
+	std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	const uint8_t* data = (const uint8_t*)contents.data();
+	if (contents.size() >= sizeof(TREE_BINARY_MAGIC) && memcmp(data, TREE_BINARY_MAGIC, sizeof(TREE_BINARY_MAGIC)) == 0) {
+		return LoadBinary(data, contents.size(), path);
+	}
+	return LoadText(contents, path);
+#endif
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+
+// Data-driven behavior tree definitions.
+//
+// Text form, for authoring (see data/ai/behavior_trees.txt):
+//   # comments run to the end of the line
+//   def chase = Sequence(ChasePlayer, AttackPlayer)     # reusable subtree
+//   tree skeleton = Selector(Patrol, chase)              # tree used by an AI type
+//
+// Binary form, for shipping: the same trees already flattened to pre-order, loaded with a single mmap.
+// Both are checked when loaded and come out as TreeDefinitions, which BehaviorTree::build turns straight into the
+// runtime layout. Trees that end up identical (skeleton and mushroom today) are stored once and shared by name.
+
+// One node of a flattened tree: its NodeType and how many children follow it in pre-order
+struct TreeNodeDef {
+	uint8_t type;
+	uint8_t childCount;
+};
+using TreeDefinition = std::vector<TreeNodeDef>;
+
+class BehaviorTreeLibrary {
+public:
+	// picks the text or binary loader by looking at the file's header
+	bool LoadFile(const std::string& path);
+	bool LoadText(const std::string& text, const std::string& sourceName);
+	bool LoadBinary(const uint8_t* data, size_t size, const std::string& sourceName);
+	bool SaveBinary(const std::string& path) const;
+
+	// nullptr if no tree has that name
+	const TreeDefinition* Find(const std::string& name) const;
+	// trees are deduplicated, so two names can give back the same index
+	int FindIndex(const std::string& name) const;
+	const std::vector<TreeDefinition>& getTrees() const { return trees; }
+
+	// checks shape and size limits, fills error with the reason on failure
+	static bool Validate(const TreeDefinition& tree, std::string& error);
+
+private:
+	void AddTree(const std::string& name, const TreeDefinition& tree);
+
+	std::vector<TreeDefinition> trees;
+	std::unordered_map<std::string, int> names;
+};
@@ -0,0 +1,17 @@
+// internal
+#include "spatial_grid.hpp"
+
+void SpatialGrid::Clear(float newCellSize) {
+	cellSize = std::max(newCellSize, 1.f);
+	// keep capacity so rebuilding every frame doesn't reallocate
+	items.clear();
+}
+
+void SpatialGrid::Insert(uint32_t index, vec2 position) {
+	items.push_back({ Key(CellCoord(position.x), CellCoord(position.y)), index });
+}
+
+void SpatialGrid::Build() {
+	// stable so items in the same cell keep insertion (registry) order
+	std::stable_sort(items.begin(), items.end(), [](const Item& a, const Item& b) { return a.key < b.key; });
+}
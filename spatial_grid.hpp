@@ -0,0 +1,78 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#include "common.hpp"
+
+// Uniform grid used for "who is near this point" queries.
+// Items are bucketed by cell and sorted once per rebuild, so a query only scans the cells overlapping its radius
+// instead of every entity. The grid stores an index into caller-owned arrays, not the entity itself.
+class SpatialGrid {
+public:
+	void Clear(float newCellSize);
+	void Insert(uint32_t index, vec2 position);
+	// must be called after inserting and before querying
+	void Build();
+
+	// Calls visit(index) for every item whose cell overlaps the square around center - callers still do the exact radius check
+	template <typename Visitor>
+	void Query(vec2 center, float radius, Visitor&& visit) const {
+		QueryRanges(center, radius, [&](size_t begin, size_t end) {
+			for (size_t slot = begin; slot < end; slot++) {
+				visit(items[slot].index);
+			}
+		});
+	}
+
+	// Same as Query, but hands back [begin, end) ranges of sorted slots instead of single items.
+	// Cells in the same row are contiguous in key order, so there is one range (and one search) per row.
+	// Data laid out in slot order (see IndexAt) can then be scanned linearly.
+	template <typename Visitor>
+	void QueryRanges(vec2 center, float radius, Visitor&& visit) const {
+		int minX = CellCoord(center.x - radius);
+		int maxX = CellCoord(center.x + radius);
+		int minY = CellCoord(center.y - radius);
+		int maxY = CellCoord(center.y + radius);
+
+		for (int y = minY; y <= maxY; y++) {
+			uint64_t endKey = Key(maxX, y);
+			auto begin = std::lower_bound(items.begin(), items.end(), Key(minX, y),
+				[](const Item& item, uint64_t key) { return item.key < key; });
+			auto end = begin;
+			while (end != items.end() && end->key <= endKey) ++end;
+			if (begin != end) {
+				visit((size_t)(begin - items.begin()), (size_t)(end - items.begin()));
+			}
+		}
+	}
+
+	// index that was inserted at the given sorted slot
+	uint32_t IndexAt(size_t slot) const { return items[slot].index; }
+	// cell of the item at the given sorted slot - slots in the same cell are next to each other
+	uint64_t CellKeyAt(size_t slot) const { return items[slot].key; }
+	static uint64_t CellKey(int x, int y) { return Key(x, y); }
+	static void CellCoords(uint64_t key, int& x, int& y) {
+		x = (int)((uint32_t)key ^ 0x80000000u);
+		y = (int)((uint32_t)(key >> 32) ^ 0x80000000u);
+	}
+	size_t size() const { return items.size(); }
+	float getCellSize() const { return cellSize; }
+
+private:
+	struct Item {
+		uint64_t key;
+		uint32_t index;
+	};
+
+	int CellCoord(float v) const { return (int)std::floor(v / cellSize); }
+	static uint64_t Key(int x, int y) {
+		// flip the sign bit so negative coordinates still sort in order
+		return ((uint64_t)((uint32_t)y ^ 0x80000000u) << 32) | ((uint32_t)x ^ 0x80000000u);
+	}
+
+	float cellSize = 1.f;
+	std::vector<Item> items;
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <new>
+#include <algorithm>
+
+// Bump allocator that owns every object of one behavior tree.
+// Objects are placed back to back in one block (a tree of a handful of nodes never needs a second one) and are all
+// destroyed and released together when the arena goes away, so rebuilding the AI system on a level restart doesn't leak.
+class TreeArena {
+public:
+	static const size_t DEFAULT_BLOCK_SIZE = 2048;
+
+	explicit TreeArena(size_t blockSize = DEFAULT_BLOCK_SIZE) : blockSize(blockSize) {}
+	~TreeArena() { clear(); }
+
+	TreeArena(const TreeArena&) = delete;
+	TreeArena& operator=(const TreeArena&) = delete;
+
+	template <typename T, typename... Args>
+	T* create(Args&&... args) {
+		void* memory = allocate(sizeof(T), alignof(T));
+		T* object = new (memory) T(std::forward<Args>(args)...);
+		destructors.push_back({ object, [](void* p) { static_cast<T*>(p)->~T(); } });
+		return object;
+	}
+
+	// destroys everything in reverse creation order and frees the blocks
+	void clear() {
+		for (auto it = destructors.rbegin(); it != destructors.rend(); ++it) {
+			it->destroy(it->object);
+		}
+		destructors.clear();
+		blocks.clear();
+		used = 0;
+		capacity = 0;
+	}
+
+private:
+	struct Destructor {
+		void* object;
+		void (*destroy)(void*);
+	};
+
+	// new char[] is aligned for any fundamental type, so aligning the offset within the block is enough
+	void* allocate(size_t size, size_t align) {
+		size_t offset = (used + align - 1) & ~(align - 1);
+		if (blocks.empty() || offset + size > capacity) {
+			capacity = std::max(blockSize, size);
+			blocks.emplace_back(new char[capacity]);
+			offset = 0;
+		}
+		used = offset + size;
+		return blocks.back().get() + offset;
+	}
+
+	size_t blockSize;
+	size_t used = 0;
+	size_t capacity = 0;
+	std::vector<std::unique_ptr<char[]>> blocks;
+	std::vector<Destructor> destructors;
+};